@@ -3,17 +3,35 @@
 set(qite_SOURCES
     ${CMAKE_CURRENT_LIST_DIR}/qite.cpp
     ${CMAKE_CURRENT_LIST_DIR}/qiteaudio.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/qiteaudiobackend.cpp
     ${CMAKE_CURRENT_LIST_DIR}/qiteprogress.cpp
     ${CMAKE_CURRENT_LIST_DIR}/qiteaudiorecorder.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/qitehistogram.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/qitereadahead.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/qitestats.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/qitetrace.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/qiterender.cpp
     )
 
 set(qite_HEADERS
     ${CMAKE_CURRENT_LIST_DIR}/qite.h
     ${CMAKE_CURRENT_LIST_DIR}/qiteaudio.h
+    ${CMAKE_CURRENT_LIST_DIR}/qiteaudiobackend.h
     ${CMAKE_CURRENT_LIST_DIR}/qiteprogress.h
     ${CMAKE_CURRENT_LIST_DIR}/qiteaudiorecorder.h
+    ${CMAKE_CURRENT_LIST_DIR}/qitehistogram.h
+    ${CMAKE_CURRENT_LIST_DIR}/qitereadahead.h
+    ${CMAKE_CURRENT_LIST_DIR}/qitestats.h
+    ${CMAKE_CURRENT_LIST_DIR}/qitetrace.h
+    ${CMAKE_CURRENT_LIST_DIR}/qiterender.h
     )
 
+# hot-path counters and timers. see qitestats.h
+option(QITE_STATS "Collect InteractiveText statistics and traces" OFF)
+if(QITE_STATS)
+    add_definitions(-DQITE_STATS)
+endif()
+
 include_directories(
     ${CMAKE_CURRENT_LIST_DIR}
     )
@@ -3,13 +3,28 @@
 SOURCES += \
     $$PWD/qite.cpp \
     $$PWD/qiteaudio.cpp \
+    $$PWD/qiteaudiobackend.cpp \
     $$PWD/qiteprogress.cpp \
-    $$PWD/qiteaudiorecorder.cpp
+    $$PWD/qiteaudiorecorder.cpp \
+    $$PWD/qitehistogram.cpp \
+    $$PWD/qitereadahead.cpp \
+    $$PWD/qitestats.cpp \
+    $$PWD/qitetrace.cpp \
+    $$PWD/qiterender.cpp
 
 HEADERS += \
     $$PWD/qite.h \
     $$PWD/qiteaudio.h \
+    $$PWD/qiteaudiobackend.h \
     $$PWD/qiteprogress.h \
-    $$PWD/qiteaudiorecorder.h
+    $$PWD/qiteaudiorecorder.h \
+    $$PWD/qitehistogram.h \
+    $$PWD/qitereadahead.h \
+    $$PWD/qitestats.h \
+    $$PWD/qitetrace.h \
+    $$PWD/qiterender.h
 
 INCLUDEPATH += $$PWD
+
+# CONFIG += qite_stats to collect hot-path counters and timers. see qitestats.h
+qite_stats: DEFINES += QITE_STATS
@@ -18,18 +18,57 @@ under the License.
 */
 
 #include "qite.h"
+#include "qitestats.h"
+#include "qitetrace.h"
 
+#include <QAtomicInteger>
+#include <QDataStream>
+#include <QElapsedTimer>
 #include <QDebug>
+#include <QGuiApplication>
 #include <QHoverEvent>
 #include <QPainter>
+#include <QScreen>
 #include <QScrollBar>
 #include <QTextBlock>
 #include <QTextDocument>
 #include <QTextEdit>
 #include <QTextObjectInterface>
+#include <QThreadPool>
+#include <QTimer>
+#include <QWindow>
+#include <algorithm>
 
 // #define DEBUG_QITE
 
+namespace {
+const char    SnapshotMagic[] = "QITESNAP";
+const quint32 SnapshotVersion = 1;
+
+QAtomicInteger<quint32> lastElementId; // shared controllers need ids unique across InteractiveText instances
+QAtomicInteger<int>     lastObjectType(QTextFormat::UserObject - 1); // and object types as well
+
+int nextObjectType(int baseObjectType)
+{
+    int current = lastObjectType.fetchAndAddOrdered(0);
+    int type;
+    do {
+        type = qMax(current + 1, baseObjectType);
+    } while (!lastObjectType.testAndSetOrdered(current, type, current));
+    return type;
+}
+
+QElapsedTimer &frameClock()
+{
+    static QElapsedTimer clock = []() {
+        QElapsedTimer timer;
+        timer.start();
+        return timer;
+    }();
+    return clock;
+}
+}
+
 //----------------------------------//
 // InteractiveTextElementController //
 //----------------------------------//
@@ -37,12 +76,15 @@ InteractiveTextElementController::InteractiveTextElementController(InteractiveTe
     QObject(parent), itc(it)
 {
     objectType = itc->registerController(this);
+    _texts.append(itc);
 }
 
 InteractiveTextElementController::~InteractiveTextElementController()
 {
-    if (itc) {
-        itc->unregisterController(this);
+    for (auto const &text : std::as_const(_texts)) {
+        if (text) {
+            text->unregisterController(this);
+        }
     }
 #ifdef DEBUG_QITE
     qDebug("InteractiveTextElementController destroyed");
@@ -52,10 +94,143 @@ InteractiveTextElementController::~InteractiveTextElementController()
 void InteractiveTextElementController::drawObject(QPainter *painter, const QRectF &rect, QTextDocument *doc,
                                                   int posInDocument, const QTextFormat &format)
 {
-    Q_UNUSED(doc)
+    auto text = textOf(doc);
+    if (!text) {
+        return;
+    }
     auto elementId = InteractiveTextFormat::id(format);
-    itc->markVisible(elementId);
+    text->markVisible(elementId, rect.toAlignedRect()); // QTextEdit paints in document coordinates
+    if (text->drawRasterized(painter, rect, elementId, format)) {
+        return;
+    }
+    if (text->_recordingDraws) {
+        text->_deferredDraws.append({ this, painter->worldTransform(), { rect, posInDocument, format } });
+        return;
+    }
+    QITE_STATS_TIMER(DrawITE, metaObject()->className());
+    _paintingText = text;
     drawITE(painter, rect, posInDocument, format);
+    _paintingText = nullptr;
+}
+
+bool InteractiveTextElementController::attach(InteractiveText *text)
+{
+    if (!text || _texts.contains(text)) {
+        return text != nullptr;
+    }
+    if (!text->registerController(this, objectType)) {
+        qWarning("InteractiveTextElementController: object type %d is taken by another controller", objectType);
+        return false;
+    }
+    _texts.append(text);
+    if (!itc) {
+        itc = text;
+    }
+    return true;
+}
+
+void InteractiveTextElementController::detach(InteractiveText *text)
+{
+    if (text && _texts.contains(text)) {
+        text->unregisterController(this);
+        forget(text);
+    }
+}
+
+void InteractiveTextElementController::forget(InteractiveText *text)
+{
+    _texts.removeAll(text);
+    _texts.removeAll(QPointer<InteractiveText>());
+    for (auto it = _owners.begin(); it != _owners.end();) {
+        if (!it.value() || it.value() == text) {
+            it = _owners.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (itc == text) {
+        itc = _texts.value(0);
+    }
+}
+
+QTextCursor InteractiveTextElementController::findElement(quint32 elementId, int cursorPositionHint)
+{
+    if (_texts.size() <= 1) {
+        return itc ? itc->findElement(elementId, cursorPositionHint) : QTextCursor();
+    }
+    auto owner = _owners.value(elementId);
+    if (owner) {
+        auto cursor = owner->findElement(elementId, cursorPositionHint);
+        if (!cursor.isNull()) {
+            return cursor;
+        }
+    }
+    for (auto const &text : std::as_const(_texts)) {
+        if (!text || text == owner) {
+            continue;
+        }
+        auto cursor = text->findElement(elementId, cursorPositionHint);
+        if (!cursor.isNull()) {
+            _owners.insert(elementId, text);
+            return cursor;
+        }
+    }
+    _owners.remove(elementId);
+    return QTextCursor();
+}
+
+QTextCursor InteractiveTextElementController::findNextElement(const QTextCursor &from)
+{
+    auto text = textOf(from.document());
+    return text ? text->findNextElement(from, objectType) : QTextCursor();
+}
+
+InteractiveText *InteractiveTextElementController::textOf(const QTextDocument *document) const
+{
+    if (itc && itc->document() == document) {
+        return itc; // the usual case
+    }
+    for (auto const &text : _texts) {
+        if (text && text->document() == document) {
+            return text;
+        }
+    }
+    return nullptr;
+}
+
+bool InteractiveTextElementController::isLowDetail() const { return _paintingText && _paintingText->isLowDetail(); }
+
+InteractiveTextElementController::Rasterizer InteractiveTextElementController::rasterizer(const QTextFormat &format)
+{
+    Q_UNUSED(format)
+    return Rasterizer();
+}
+
+void InteractiveTextElementController::elementMemoryUsage(ITEMemoryUsage &usage, const QTextFormat &format) const
+{
+    usage.addElement(QLatin1String("char formats"), InteractiveTextFormat::id(format),
+                     ITEMemoryUsage::formatBytes(format));
+}
+
+void InteractiveTextElementController::memoryUsage(ITEMemoryUsage &usage) const
+{
+    qint64 bytes = 0;
+    for (auto it = _staticTexts.constBegin(); it != _staticTexts.constEnd(); ++it) {
+        // laid out glyphs take roughly an index and a position per character
+        bytes += ITEMemoryUsage::stringBytes(it->source)
+            + it->source.size() * qint64(sizeof(quint32) + sizeof(QPointF));
+    }
+    bytes += ITEMemoryUsage::nodesBytes(_staticTexts.size(), sizeof(quint32) + sizeof(StaticTextEntry));
+    usage.add(QLatin1String("static texts"), bytes, _staticTexts.size());
+}
+
+void InteractiveTextElementController::drawITEs(QPainter *painter, const QVector<DrawCommand> &commands)
+{
+    for (auto const &c : commands) {
+        painter->save();
+        drawITE(painter, c.rect, c.posInDocument, c.format);
+        painter->restore();
+    }
 }
 
 bool InteractiveTextElementController::mouseEvent(const Event &event, const QRect &rect, QTextCursor &selected)
@@ -68,14 +243,101 @@ bool InteractiveTextElementController::mouseEvent(const Event &event, const QRec
 
 void InteractiveTextElementController::hideEvent(QTextCursor &selected) { Q_UNUSED(selected) }
 
+void InteractiveTextElementController::preloadEvent(QTextCursor &selected) { Q_UNUSED(selected) }
+
+void InteractiveTextElementController::pageOutEvent(QTextCursor &selected) { Q_UNUSED(selected) }
+
+QTextCharFormat InteractiveTextElementController::snapshotFormat(const QTextCharFormat &format) const
+{
+    return format;
+}
+
+void InteractiveTextElementController::restoreFormat(QTextCharFormat &format) { Q_UNUSED(format) }
+
+void InteractiveTextElementController::saveState(QDataStream &stream) const { Q_UNUSED(stream) }
+
+void InteractiveTextElementController::restoreState(QDataStream &stream, const QHash<quint32, quint32> &ids)
+{
+    Q_UNUSED(stream)
+    Q_UNUSED(ids)
+}
+
+bool InteractiveTextElementController::animationFrame(quint32 elementId, qint64 frameTime)
+{
+    Q_UNUSED(elementId)
+    Q_UNUSED(frameTime)
+    return true;
+}
+
+const QStaticText &InteractiveTextElementController::staticText(quint32 elementId, const QString &text,
+                                                                 const QFont &font, int width)
+{
+    auto it = _staticTexts.find(elementId);
+    if (it != _staticTexts.end()) {
+        it->lastUse = ++_staticTextUses;
+        if (it->width != width || it->font != font || it->source != text) {
+            // the element has changed. its previous text isn't needed anymore
+            it->source = text;
+            it->font   = font;
+            it->width  = width;
+            it->text   = makeStaticText(text, font, width);
+        }
+        return it->text;
+    }
+    if (_staticTexts.size() >= 256) {
+        // rather a lot of elements on the screen. forget the one not painted for the longest time
+        auto oldest = _staticTexts.begin();
+        for (auto e = _staticTexts.begin(); e != _staticTexts.end(); ++e) {
+            if (e->lastUse < oldest->lastUse) {
+                oldest = e;
+            }
+        }
+        _staticTexts.erase(oldest);
+    }
+    StaticTextEntry entry { text, font, width, makeStaticText(text, font, width), ++_staticTextUses };
+    return _staticTexts.insert(elementId, entry)->text;
+}
+
+QStaticText InteractiveTextElementController::makeStaticText(const QString &text, const QFont &font, int width)
+{
+    QStaticText st(QFontMetrics(font).elidedText(text, Qt::ElideRight, width));
+    st.setTextFormat(Qt::PlainText);
+    st.prepare(QTransform(), font);
+    return st;
+}
+
+void InteractiveTextElementController::startAnimation(quint32 elementId)
+{
+    InteractiveText *text = itc;
+    if (_texts.size() > 1) {
+        findElement(elementId); // remembers where it is
+        text = _owners.value(elementId);
+    }
+    if (text) {
+        text->startAnimation(this, elementId);
+    }
+}
+
+void InteractiveTextElementController::stopAnimation(quint32 elementId)
+{
+    for (auto const &text : std::as_const(_texts)) {
+        if (text) {
+            text->stopAnimation(elementId);
+        }
+    }
+}
+
 QCursor InteractiveTextElementController::cursor() { return QCursor(Qt::IBeamCursor); }
 
 //---------------------------//
 // InteractiveTextController //
 //---------------------------//
 InteractiveText::InteractiveText(QTextEdit *textEdit, int baseObjectType) :
-    QObject(textEdit), _textEdit(textEdit), _baseObjectType(baseObjectType), _objectType(baseObjectType)
+    QObject(textEdit), _textEdit(textEdit), _document(textEdit->document()), _baseObjectType(baseObjectType)
 {
+    init();
+
+    // the widget adapter. everything below is about the viewport
     textEdit->installEventFilter(this);
     textEdit->viewport()->installEventFilter(this);
 
@@ -86,10 +348,64 @@ InteractiveText::InteractiveText(QTextEdit *textEdit, int baseObjectType) :
         textEdit->horizontalScrollBar(), &QScrollBar::valueChanged, this, [this](int) { trackVisibility(); },
         Qt::QueuedConnection);
     connect(textEdit, &QTextEdit::textChanged, this, &InteractiveText::trackVisibility, Qt::QueuedConnection);
+
+    // velocity has to be known before the scrolled content is painted. so no queued connections here
+    _lastScrollValue = QPoint(textEdit->horizontalScrollBar()->value(), textEdit->verticalScrollBar()->value());
+    connect(textEdit->verticalScrollBar(), &QScrollBar::valueChanged, this, &InteractiveText::scrolled);
+    connect(textEdit->horizontalScrollBar(), &QScrollBar::valueChanged, this, &InteractiveText::scrolled);
+}
+
+InteractiveText::InteractiveText(QTextDocument *document, int baseObjectType, QObject *parent) :
+    QObject(parent), _document(document), _baseObjectType(baseObjectType)
+{
+    init();
+}
+
+void InteractiveText::init()
+{
+    _frameTimer = new QTimer(this);
+    _frameTimer->setTimerType(Qt::PreciseTimer);
+    connect(_frameTimer, &QTimer::timeout, this, &InteractiveText::animationTick);
+
+    _settleTimer = new QTimer(this);
+    _settleTimer->setSingleShot(true);
+    _settleTimer->setInterval(150);
+    connect(_settleTimer, &QTimer::timeout, this, &InteractiveText::scrollSettled);
+#ifdef QITE_STATS
+    connect(_document, &QTextDocument::contentsChange, this, [](int, int charsRemoved, int charsAdded) {
+        if (charsRemoved == charsAdded) {
+            QITE_STATS_ADD(CharFormatWrites, 1); // likely QTextCursor::setCharFormat
+        }
+    });
+#endif
+
+    _rasterPool = new QThreadPool(this);
+    _rasterPool->setMaxThreadCount(1); // it's just idle work
+    _rasterTimer = new QTimer(this);
+    _rasterTimer->setSingleShot(true);
+    _rasterTimer->setInterval(100);
+    connect(_rasterTimer, &QTimer::timeout, this, &InteractiveText::rasterizeAhead);
+
+    _historyTimer = new QTimer(this);
+    _historyTimer->setSingleShot(true);
+    _historyTimer->setInterval(100); // pages move once scrolling pauses
+    connect(_historyTimer, &QTimer::timeout, this, &InteractiveText::updateHistoryWindow);
+    connect(_document, &QTextDocument::blockCountChanged, this, [this](int) {
+        if (_historyWindow > 0) {
+            _historyTimer->start();
+        }
+    });
 }
 
 InteractiveText::~InteractiveText()
 {
+    // the jobs post their results to this object
+    _rasterPool->clear();
+    _rasterPool->waitForDone();
+    delete _inputTrace;
+    for (auto controller : std::as_const(_controllers)) {
+        controller->forget(this); // shared ones continue with other texts
+    }
 #ifdef DEBUG_QITE
     qDebug("InteractiveText destroyed");
 #endif
@@ -97,51 +413,110 @@ InteractiveText::~InteractiveText()
 
 int InteractiveText::registerController(InteractiveTextElementController *elementController)
 {
-    auto           objectType = _objectType++;
-    QTextDocument *doc        = _textEdit->document();
-    doc->documentLayout()->registerHandler(objectType, elementController);
+    auto objectType = nextObjectType(_baseObjectType); // never taken in any other InteractiveText
+    _document->documentLayout()->registerHandler(objectType, elementController);
     _controllers.insert(objectType, elementController);
+    _controllersOrder.append(elementController);
     return objectType;
 }
 
+bool InteractiveText::registerController(InteractiveTextElementController *elementController, int objectType)
+{
+    auto registered = _controllers.value(objectType);
+    if (registered) {
+        return registered == elementController;
+    }
+    _document->documentLayout()->registerHandler(objectType, elementController);
+    _controllers.insert(objectType, elementController);
+    _controllersOrder.append(elementController);
+    return true;
+}
+
 void InteractiveText::unregisterController(InteractiveTextElementController *elementController)
 {
-    if (_textEdit)
-        _textEdit->document()->documentLayout()->unregisterHandler(elementController->objectType, elementController);
+    if (_document)
+        _document->documentLayout()->unregisterHandler(elementController->objectType, elementController);
     _controllers.remove(elementController->objectType);
+    _controllersOrder.removeOne(elementController);
+    _rasterCache.clear();
+    for (auto it = _animations.begin(); it != _animations.end();) {
+        if (it->controller == elementController) {
+            it = _animations.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+InteractiveTextFormat::ElementId InteractiveText::nextId() { return ++lastElementId; }
+
+qint64 InteractiveText::frameTime() { return frameClock().elapsed(); }
+
+QFont InteractiveText::defaultFont() const
+{
+    if (_textEdit) {
+        return _textEdit->currentFont();
+    }
+    return _document ? _document->defaultFont() : QFont();
 }
 
-InteractiveTextFormat::ElementId InteractiveText::nextId() { return ++_uniqueElementId; }
+void InteractiveText::setPreloadMargin(int pixels)
+{
+    _preloadMargin = pixels;
+    trackVisibility();
+}
 
 void InteractiveText::insert(const InteractiveTextFormat &fmt)
 {
-    _textEdit->textCursor().insertText(QString(QChar::ObjectReplacementCharacter), fmt);
+    QTextCursor cursor;
+    if (_textEdit) {
+        cursor = _textEdit->textCursor();
+    } else {
+        cursor = QTextCursor(_document);
+        cursor.movePosition(QTextCursor::End);
+    }
+    cursor.insertText(QString(QChar::ObjectReplacementCharacter), fmt);
     // TODO check if mouse is already on the element
 }
 
 QTextCursor InteractiveText::findElement(quint32 elementId, int cursorPositionHint)
 {
-    QTextCursor cursor(_textEdit->document());
-    cursor.setPosition(cursorPositionHint);
+    QTextCursor cursor(_document);
+    // the hint may come from another document if the controller is shared
+    cursor.setPosition(qBound(0, cursorPositionHint, _document->characterCount() - 1));
 
     cursor.movePosition(QTextCursor::Right, QTextCursor::KeepAnchor);
     QString selectedText = cursor.selectedText();
     if (selectedText.size() && selectedText[0] == QChar::ObjectReplacementCharacter) {
         QTextCharFormat fmt   = cursor.charFormat();
         auto            otype = fmt.objectType();
-        if (otype >= _baseObjectType && otype < _objectType
-            && fmt.property(InteractiveTextFormat::Id).toUInt() == elementId) {
+        if (_controllers.contains(otype) && fmt.property(InteractiveTextFormat::Id).toUInt() == elementId) {
+            QITE_STATS_ADD(FindElementHintHits, 1);
             return cursor;
         }
     }
 
+    QITE_STATS_ADD(FindElementScans, 1);
     cursor.setPosition(0);
     QString elText(QChar::ObjectReplacementCharacter);
-    while (!(cursor = _textEdit->document()->find(elText, cursor)).isNull()) {
+    while (!(cursor = _document->find(elText, cursor)).isNull()) {
+        QITE_STATS_ADD(FindElementScanned, 1);
         QTextCharFormat fmt   = cursor.charFormat();
         auto            otype = fmt.objectType();
-        if (otype >= _baseObjectType && otype < _objectType
-            && fmt.property(InteractiveTextFormat::Id).toUInt() == elementId) {
+        if (_controllers.contains(otype) && fmt.property(InteractiveTextFormat::Id).toUInt() == elementId) {
+            break;
+        }
+    }
+    return cursor;
+}
+
+QTextCursor InteractiveText::findNextElement(const QTextCursor &from, int objectType)
+{
+    QTextCursor cursor(_document);
+    cursor.setPosition(qMax(from.anchor(), from.position()));
+    QString elText(QChar::ObjectReplacementCharacter);
+    while (!(cursor = _document->find(elText, cursor)).isNull()) {
+        if (cursor.charFormat().objectType() == objectType) {
             break;
         }
     }
@@ -150,11 +525,28 @@ QTextCursor InteractiveText::findElement(quint32 elementId, int cursorPositionHi
 
 bool InteractiveText::eventFilter(QObject *obj, QEvent *event)
 {
+    if (_inputTrace && _textEdit && (obj == _textEdit || obj == _textEdit->viewport())) {
+        _inputTrace->writeEvent(event, obj != _textEdit);
+    }
     if (obj == _textEdit && event->type() == QEvent::Resize) {
         trackVisibility();
         return false;
     }
 
+    if (event->type() == QEvent::Paint && _deferredPainting && !_recordingDraws && obj == _textEdit->viewport()) {
+        // let QTextEdit paint the text while elements are only recorded, then paint them on top
+        _recordingDraws = true;
+        QCoreApplication::sendEvent(obj, event);
+        _recordingDraws = false;
+        if (!_deferredDraws.isEmpty()) {
+            QPainter painter(_textEdit->viewport());
+            flushDeferredDraws(&painter);
+        }
+        return true;
+    }
+    QITE_STATS_ADD(EventFilterCalls, 1);
+    QITE_STATS_TIMER(EventFilter, nullptr);
+
 #if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
 #define MoveMoveEvent QEvent::HoverMove
     bool ourEvent = (obj == _textEdit
@@ -189,9 +581,10 @@ bool InteractiveText::eventFilter(QObject *obj, QEvent *event)
     if (event->type() == QEvent::HoverEnter || event->type() == MoveMoveEvent
         || event->type() == QEvent::MouseButtonPress) {
         QPoint viewportOffset(_textEdit->horizontalScrollBar()->value(), _textEdit->verticalScrollBar()->value());
-        int    docLPos = _textEdit->document()->documentLayout()->hitTest(pos + viewportOffset, Qt::ExactHit);
+        QITE_STATS_ADD(HitTests, 1);
+        int docLPos = _document->documentLayout()->hitTest(pos + viewportOffset, Qt::ExactHit);
         if (docLPos != -1) {
-            QTextCursor cursor(_textEdit->document());
+            QTextCursor cursor(_document);
             cursor.setPosition(docLPos);
             cursor.movePosition(QTextCursor::Right, QTextCursor::KeepAnchor);
             const auto &selection = cursor.selectedText();
@@ -271,7 +664,707 @@ void InteractiveText::checkAndGenerateLeaveEvent(QEvent *event)
     }
 }
 
-void InteractiveText::markVisible(const InteractiveTextFormat::ElementId &id) { _visibleElements.insert(id); }
+void InteractiveText::markVisible(const InteractiveTextFormat::ElementId &id)
+{
+    if (_textEdit) {
+        _visibleElements.insert(id);
+    }
+}
+
+void InteractiveText::markVisible(const InteractiveTextFormat::ElementId &id, const QRect &docRect)
+{
+    if (!_textEdit) {
+        return; // nothing would hide it
+    }
+    _visibleElements.insert(id);
+    auto it = _animations.find(id);
+    if (it != _animations.end()) {
+        it->rect = docRect;
+        if (!_frameTimer->isActive()) {
+            _frameTimer->start(); // it's on the screen again
+        }
+    }
+}
+
+void InteractiveText::startAnimation(InteractiveTextElementController *controller, InteractiveTextFormat::ElementId id)
+{
+    if (!_textEdit) {
+        return; // a still image
+    }
+    auto &animation      = _animations[id];
+    animation.controller = controller;
+    if (!_frameTimer->isActive()) {
+        // widgets don't have vsync. so just tick with the refresh rate of the screen
+        auto  screen      = _textEdit->window()->windowHandle() ? _textEdit->window()->windowHandle()->screen()
+                                                                : QGuiApplication::primaryScreen();
+        qreal refreshRate = screen ? screen->refreshRate() : 60.0;
+        _frameTimer->setInterval(qMax(1, qRound(1000.0 / (refreshRate > 0 ? refreshRate : 60.0))));
+        _frameTimer->start();
+    }
+}
+
+void InteractiveText::stopAnimation(InteractiveTextFormat::ElementId id)
+{
+    _animations.remove(id);
+    if (_animations.isEmpty()) {
+        _frameTimer->stop();
+    }
+}
+
+void InteractiveText::flushDeferredDraws(QPainter *painter)
+{
+    // group by controller. elements don't overlap so the order doesn't matter. unlike stable_sort it's in place
+    std::sort(_deferredDraws.begin(), _deferredDraws.end(),
+              [](const DeferredDraw &a, const DeferredDraw &b) { return a.controller < b.controller; });
+
+    for (int i = 0; i < _deferredDraws.size();) {
+        auto const &first = _deferredDraws[i];
+        _drawGroup.clear();
+        int j = i;
+        for (; j < _deferredDraws.size() && _deferredDraws[j].controller == first.controller
+             && _deferredDraws[j].transform == first.transform;
+             j++) {
+            _drawGroup.append(_deferredDraws[j].command);
+        }
+        QITE_STATS_TIMER(DrawITE, first.controller->metaObject()->className());
+        painter->save();
+        painter->setWorldTransform(first.transform);
+        first.controller->_paintingText = this;
+        first.controller->drawITEs(painter, _drawGroup);
+        first.controller->_paintingText = nullptr;
+        painter->restore();
+        i = j;
+    }
+    _deferredDraws.clear();
+    _drawGroup.clear(); // don't hold the formats
+}
+
+void InteractiveText::scrolled()
+{
+    if (!_textEdit) {
+        return;
+    }
+    QPoint value(_textEdit->horizontalScrollBar()->value(), _textEdit->verticalScrollBar()->value());
+    auto   now      = frameTime();
+    auto   distance = (value - _lastScrollValue).manhattanLength();
+    auto   elapsed  = qMax(qint64(1), now - _lastScrollTime);
+
+    _lastScrollValue = value;
+    _lastScrollTime  = now;
+    if (_inputTrace) {
+        _inputTrace->write(ITEInputTrace::Scroll, value);
+    }
+
+    if (_fastScrollSpeed > 0 && distance * 1000 / elapsed > _fastScrollSpeed) {
+        _lowDetail = true;
+    }
+    if (_lowDetail) {
+        _settleTimer->start(); // restart
+    }
+    if (_historyWindow > 0) {
+        _historyTimer->start();
+    }
+}
+
+void InteractiveText::scrollSettled()
+{
+    _lowDetail = false;
+    if (_textEdit) {
+        _textEdit->viewport()->update();
+    }
+}
+
+void InteractiveText::setRasterCacheSize(int count)
+{
+    _rasterCacheSize = count;
+    trimRasterCache(qMax(0, count));
+}
+
+void InteractiveText::trimRasterCache(int count)
+{
+    // the cache is small, so a scan is cheaper than keeping an order
+    while (_rasterCache.size() > count) {
+        auto oldest = _rasterCache.begin();
+        for (auto it = _rasterCache.begin(); it != _rasterCache.end(); ++it) {
+            if (it->lastUse < oldest->lastUse) {
+                oldest = it;
+            }
+        }
+        _rasterCache.erase(oldest);
+    }
+}
+
+void InteractiveText::setInputTrace(QIODevice *device)
+{
+    delete _inputTrace;
+    _inputTrace = nullptr;
+    if (!device || !_textEdit) {
+        return;
+    }
+    // the replay starts from the same state
+    _inputTrace = new ITEInputTraceWriter(device);
+    _inputTrace->write(ITEInputTrace::Resize, QPoint(_textEdit->width(), _textEdit->height()));
+    _inputTrace->write(ITEInputTrace::Scroll, _lastScrollValue);
+}
+
+void InteractiveText::render(QPainter *painter, const QRectF &clip)
+{
+    if (!_document) {
+        return;
+    }
+    QAbstractTextDocumentLayout::PaintContext context;
+    painter->save();
+    if (clip.isValid()) {
+        painter->setClipRect(clip);
+        context.clip = clip;
+    }
+    _recordingDraws = _deferredPainting;
+    _document->documentLayout()->draw(painter, context);
+    _recordingDraws = false;
+    flushDeferredDraws(painter);
+    painter->restore();
+}
+
+ITEMemoryUsage InteractiveText::memoryUsage() const
+{
+    ITEMemoryUsage usage;
+    if (!_document) {
+        return usage;
+    }
+
+    for (auto block = _document->begin(); block.isValid(); block = block.next()) {
+        for (auto it = block.begin(); !it.atEnd(); ++it) {
+            auto format     = it.fragment().charFormat();
+            auto controller = _controllers.value(format.objectType());
+            if (controller) {
+                controller->elementMemoryUsage(usage, format);
+            }
+        }
+    }
+
+    const auto idBytes = ITEMemoryUsage::nodesBytes(1, sizeof(InteractiveTextFormat::ElementId));
+    for (auto id : _visibleElements) {
+        usage.addElement(QLatin1String("visible elements"), id, idBytes);
+    }
+    for (auto id : _preloadedElements) {
+        usage.addElement(QLatin1String("preloaded elements"), id, idBytes);
+    }
+    for (auto it = _animations.constBegin(); it != _animations.constEnd(); ++it) {
+        usage.addElement(QLatin1String("animations"), it.key(),
+                         ITEMemoryUsage::nodesBytes(1, sizeof(InteractiveTextFormat::ElementId) + sizeof(Animation)));
+    }
+    for (auto it = _rasterCache.constBegin(); it != _rasterCache.constEnd(); ++it) {
+        usage.addElement(QLatin1String("raster cache"), it.key(),
+                         ITEMemoryUsage::formatBytes(it->format) + it->image.sizeInBytes());
+    }
+    usage.add(QLatin1String("paint buffers"),
+              _deferredDraws.capacity() * qint64(sizeof(DeferredDraw))
+                  + _drawGroup.capacity() * qint64(sizeof(InteractiveTextElementController::DrawCommand)),
+              0);
+
+    for (auto const &page : _historyPages) {
+        qint64 bytes = ITEMemoryUsage::stringBytes(page.text)
+            + page.blocks.capacity() * qint64(sizeof(HistoryPage::Block))
+            + page.runs.capacity() * qint64(sizeof(HistoryPage::Run));
+        for (auto const &format : page.formats) {
+            bytes += ITEMemoryUsage::formatBytes(format);
+        }
+        usage.add(QLatin1String("paged out history"), bytes, page.blocks.size());
+    }
+
+    for (auto controller : _controllers) {
+        controller->memoryUsage(usage);
+    }
+    return usage;
+}
+
+void InteractiveText::setHistoryWindow(int blocks, int pageBlocks)
+{
+    _historyWindow     = qMax(0, blocks);
+    _historyPageBlocks = qMax(1, pageBlocks);
+    if (_historyWindow > 0) {
+        _historyTimer->start();
+        return;
+    }
+    _historyTimer->stop();
+    while (pageInHistory()) { }
+}
+
+void InteractiveText::updateHistoryWindow()
+{
+    if (!_document || _historyWindow <= 0) {
+        return;
+    }
+    auto bar        = _textEdit ? _textEdit->verticalScrollBar() : nullptr;
+    int  viewHeight = _textEdit ? _textEdit->viewport()->height() : 0;
+
+    // without a viewport pages come back only with explicit pageInHistory()
+    if (bar) {
+        while (bar->value() < viewHeight + _preloadMargin && pageInHistory()) { }
+    }
+
+    auto layout = _document->documentLayout();
+    while (_document->blockCount() > _historyWindow + _historyPageBlocks) {
+        if (bar) {
+            // keep a gap twice the viewport, so the page just put back doesn't go out again
+            auto pageBottom = layout->blockBoundingRect(_document->findBlockByNumber(_historyPageBlocks)).top();
+            if (pageBottom > bar->value() - 2 * viewHeight - _preloadMargin) {
+                break;
+            }
+        }
+        pageOutHistory(_historyPageBlocks);
+    }
+}
+
+void InteractiveText::pageOutHistory(int blockCount)
+{
+    auto doc = _document.data();
+    auto end = doc->findBlockByNumber(blockCount); // the first one staying in the document
+
+    pageOutElements(end.position()); // their format changes go to the page
+    auto page = makeHistoryPage(doc->begin(), end);
+
+    auto keepFormat     = end.blockFormat();
+    auto keepCharFormat = end.charFormat();
+    int  height         = 0;
+    if (_textEdit) {
+        auto layout = doc->documentLayout();
+        height      = int(layout->blockBoundingRect(end).top() - layout->blockBoundingRect(doc->begin()).top());
+    }
+
+    bool undo = doc->isUndoRedoEnabled();
+    doc->setUndoRedoEnabled(false); // the stack would keep the removed text
+    QTextCursor cursor(doc);
+    cursor.beginEditBlock();
+    cursor.setPosition(end.position(), QTextCursor::KeepAnchor);
+    cursor.removeSelectedText();
+    cursor.setBlockFormat(keepFormat); // the merged block may have got the format of the removed one
+    cursor.setBlockCharFormat(keepCharFormat);
+    cursor.endEditBlock();
+    doc->setUndoRedoEnabled(undo);
+    _historyPages.append(page);
+
+    if (_textEdit) {
+        _lastScrollValue.ry() -= height; // it's not a scroll for the velocity tracking
+        _textEdit->verticalScrollBar()->setValue(_textEdit->verticalScrollBar()->value() - height);
+    }
+}
+
+void InteractiveText::pageOutElements(int endPosition)
+{
+    auto        doc = _document.data();
+    QTextCursor cursor(doc);
+    QString     elText(QChar::ObjectReplacementCharacter);
+    while (!(cursor = doc->find(elText, cursor)).isNull() && cursor.selectionEnd() <= endPosition) {
+        auto controller = _controllers.value(cursor.charFormat().objectType());
+        if (!controller) {
+            continue;
+        }
+        auto id        = InteractiveTextFormat::id(cursor.charFormat());
+        bool visible   = _visibleElements.remove(id);
+        bool preloaded = _preloadedElements.remove(id);
+        if (visible || preloaded) {
+            controller->hideEvent(cursor);
+        }
+        controller->pageOutEvent(cursor);
+        _animations.remove(id);
+        _rasterCache.remove(id);
+    }
+}
+
+InteractiveText::HistoryPage InteractiveText::makeHistoryPage(const QTextBlock &begin, const QTextBlock &end) const
+{
+    HistoryPage     page;
+    QHash<int, int> formatIndexes; // in the document -> in the page
+    auto            pageFormat = [&](int index, const QTextFormat &format) {
+        auto it = formatIndexes.constFind(index);
+        if (it != formatIndexes.constEnd()) {
+            return *it;
+        }
+        page.formats.append(format);
+        return *formatIndexes.insert(index, page.formats.size() - 1);
+    };
+    for (auto block = begin; block != end; block = block.next()) {
+        HistoryPage::Block pageBlock;
+        pageBlock.blockFormat = pageFormat(block.blockFormatIndex(), block.blockFormat());
+        pageBlock.charFormat  = pageFormat(block.charFormatIndex(), block.charFormat());
+        pageBlock.runs        = 0;
+        for (auto it = block.begin(); !it.atEnd(); ++it) {
+            auto fragment = it.fragment();
+            page.text += fragment.text();
+            page.runs.append(
+                HistoryPage::Run { fragment.length(), pageFormat(fragment.charFormatIndex(), fragment.charFormat()) });
+            pageBlock.runs++;
+        }
+        page.blocks.append(pageBlock);
+    }
+    page.text.squeeze();
+    page.formats.squeeze();
+    page.runs.squeeze();
+    return page;
+}
+
+void InteractiveText::insertHistoryPage(QTextCursor &cursor, const HistoryPage &page)
+{
+    int textPosition = 0;
+    int run          = 0;
+    for (int i = 0; i < page.blocks.size(); i++) {
+        auto const &pageBlock   = page.blocks[i];
+        auto        blockFormat = page.formats[pageBlock.blockFormat].toBlockFormat();
+        auto        charFormat  = page.formats[pageBlock.charFormat].toCharFormat();
+        if (i) {
+            cursor.insertBlock(blockFormat, charFormat);
+        } else {
+            cursor.setBlockFormat(blockFormat);
+            cursor.setBlockCharFormat(charFormat);
+        }
+        for (int end = run + pageBlock.runs; run < end; run++) {
+            auto const &pageRun = page.runs[run];
+            cursor.insertText(page.text.mid(textPosition, pageRun.length),
+                              page.formats[pageRun.format].toCharFormat());
+            textPosition += pageRun.length;
+        }
+    }
+}
+
+bool InteractiveText::pageInHistory()
+{
+    if (_historyPages.isEmpty() || !_document) {
+        return false;
+    }
+    auto        page  = _historyPages.takeLast();
+    auto        doc   = _document.data();
+    auto        first = doc->begin();
+    QTextCursor cursor(doc);
+
+    bool undo = doc->isUndoRedoEnabled();
+    doc->setUndoRedoEnabled(false);
+    cursor.beginEditBlock();
+    cursor.insertBlock(first.blockFormat(), first.charFormat()); // the live content moves to a new block
+    cursor.setPosition(0);
+    insertHistoryPage(cursor, page);
+    cursor.endEditBlock();
+    doc->setUndoRedoEnabled(undo);
+
+    if (_textEdit) {
+        auto layout = doc->documentLayout();
+        int  height = int(layout->blockBoundingRect(doc->findBlockByNumber(page.blocks.size())).top()
+                         - layout->blockBoundingRect(doc->begin()).top());
+        _lastScrollValue.ry() += height;
+        _textEdit->verticalScrollBar()->setValue(_textEdit->verticalScrollBar()->value() + height);
+    }
+    return true;
+}
+
+bool InteractiveText::saveSnapshot(QIODevice *device) const
+{
+    if (!_document) {
+        return false;
+    }
+    QDataStream ds(device);
+    ds << QByteArray(SnapshotMagic) << SnapshotVersion << quint32(_controllers.size());
+    for (auto controller : _controllersOrder) {
+        QByteArray  state;
+        QDataStream stateStream(&state, QIODevice::WriteOnly);
+        controller->saveState(stateStream);
+        ds << qint32(controller->objectType) << QByteArray(controller->metaObject()->className()) << state;
+    }
+
+    ds << quint32(_historyPages.size() + 1);
+    for (auto const &page : _historyPages) {
+        writeHistoryPage(ds, page);
+    }
+    writeHistoryPage(ds, makeHistoryPage(_document->begin(), _document->end())); // the live part is the newest
+    return ds.status() == QDataStream::Ok;
+}
+
+bool InteractiveText::restoreSnapshot(QIODevice *device)
+{
+    if (!_document) {
+        return false;
+    }
+    QDataStream ds(device);
+    QByteArray  magic;
+    quint32     version = 0;
+    quint32     count   = 0;
+    ds >> magic >> version;
+    if (magic != SnapshotMagic || version != SnapshotVersion) {
+        return false;
+    }
+    ds >> count;
+    QList<QPair<int, QByteArray>> states; // current object type -> controller state
+    QHash<int, int>               types;  // saved object type -> current one
+    QHash<QByteArray, int>        classUses;
+    for (quint32 i = 0; i < count && ds.status() == QDataStream::Ok; i++) {
+        qint32     objectType;
+        QByteArray className, state;
+        ds >> objectType >> className >> state;
+        // types are handed out per process, so they differ between runs and even a shared controller attached
+        // later may have a lower one. match the n-th registered controller of the class
+        int n = classUses[className]++;
+        for (auto controller : std::as_const(_controllersOrder)) {
+            if (className == controller->metaObject()->className() && n-- == 0) {
+                types.insert(objectType, controller->objectType);
+                states.append(qMakePair(controller->objectType, state));
+                break;
+            }
+        }
+    }
+
+    // everything is read and checked before the document is touched
+    QList<HistoryPage>      pages;
+    QHash<quint32, quint32> ids; // saved -> new
+    ds >> count;
+    for (quint32 i = 0; i < count && ds.status() == QDataStream::Ok; i++) {
+        HistoryPage page;
+        if (!readHistoryPage(ds, page, types, ids)) {
+            return false;
+        }
+        pages.append(page);
+    }
+    if (ds.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    // players, requests and waiters of the current elements would outlive them otherwise
+    pageOutElements(_document->characterCount());
+    _visibleElements.clear();
+    _preloadedElements.clear();
+    _animations.clear();
+    _rasterCache.clear();
+    _historyPages.clear();
+    if (_historyWindow > 0) {
+        while (pages.size() > 1) {
+            _historyPages.append(pages.takeFirst()); // laid out only if the view comes near
+        }
+    }
+
+    auto        doc  = _document.data();
+    bool        undo = doc->isUndoRedoEnabled();
+    QTextCursor cursor(doc);
+    doc->setUndoRedoEnabled(false);
+    cursor.beginEditBlock();
+    cursor.select(QTextCursor::Document);
+    cursor.removeSelectedText();
+    for (int i = 0; i < pages.size(); i++) {
+        if (i) {
+            cursor.insertBlock();
+        }
+        insertHistoryPage(cursor, pages[i]);
+    }
+    cursor.endEditBlock();
+    doc->setUndoRedoEnabled(undo);
+
+    for (auto const &state : std::as_const(states)) {
+        QDataStream stateStream(state.second);
+        _controllers.value(state.first)->restoreState(stateStream, ids);
+    }
+    return true;
+}
+
+void InteractiveText::writeHistoryPage(QDataStream &stream, const HistoryPage &page) const
+{
+    stream << quint32(page.formats.size());
+    for (auto const &format : page.formats) {
+        auto controller = _controllers.value(format.objectType());
+        if (controller && format.isCharFormat()) {
+            stream << QTextFormat(controller->snapshotFormat(format.toCharFormat()));
+        } else {
+            stream << format;
+        }
+    }
+    stream << quint32(page.blocks.size());
+    for (auto const &block : page.blocks) {
+        stream << qint32(block.blockFormat) << qint32(block.charFormat) << qint32(block.runs);
+    }
+    stream << quint32(page.runs.size());
+    for (auto const &run : page.runs) {
+        stream << qint32(run.length) << qint32(run.format);
+    }
+    stream << page.text;
+}
+
+bool InteractiveText::readHistoryPage(QDataStream &stream, HistoryPage &page, const QHash<int, int> &types,
+                                      QHash<quint32, quint32> &ids)
+{
+    quint32 count = 0;
+    stream >> count;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++) {
+        QTextFormat format;
+        stream >> format;
+        if (format.objectType() >= QTextFormat::UserObject) {
+            auto type = types.constFind(format.objectType());
+            if (type != types.constEnd()) {
+                format.setObjectType(*type);
+            } else {
+                // its controller isn't registered now and the saved type may belong to another one
+                format.clearProperty(QTextFormat::ObjectType);
+                format.clearProperty(InteractiveTextFormat::Id);
+            }
+        }
+        auto controller = _controllers.value(format.objectType());
+        if (controller && format.isCharFormat() && format.hasProperty(InteractiveTextFormat::Id)) {
+            // saved ids may be taken already by elements of this run
+            auto charFormat = format.toCharFormat();
+            auto savedId    = charFormat.property(InteractiveTextFormat::Id).toUInt();
+            auto id         = ids.value(savedId);
+            if (!id) {
+                id = nextId();
+                ids.insert(savedId, id);
+            }
+            charFormat.setProperty(InteractiveTextFormat::Id, id);
+            controller->restoreFormat(charFormat);
+            format = charFormat;
+        }
+        page.formats.append(format);
+    }
+    stream >> count;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++) {
+        qint32 blockFormat, charFormat, runs;
+        stream >> blockFormat >> charFormat >> runs;
+        page.blocks.append(HistoryPage::Block { blockFormat, charFormat, runs });
+    }
+    stream >> count;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++) {
+        qint32 length, format;
+        stream >> length >> format;
+        page.runs.append(HistoryPage::Run { length, format });
+    }
+    stream >> page.text;
+    if (stream.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    // insertHistoryPage trusts the indexes
+    auto isFormat = [&page](int index) { return index >= 0 && index < page.formats.size(); };
+    int  runs     = 0;
+    int  length   = 0;
+    for (auto const &block : page.blocks) {
+        if (!isFormat(block.blockFormat) || !page.formats[block.blockFormat].isBlockFormat()
+            || !isFormat(block.charFormat) || block.runs < 0) {
+            return false;
+        }
+        runs += block.runs;
+    }
+    for (auto const &run : page.runs) {
+        if (!isFormat(run.format) || run.length < 0) {
+            return false;
+        }
+        length += run.length;
+    }
+    return runs == page.runs.size() && length == page.text.size();
+}
+
+bool InteractiveText::drawRasterized(QPainter *painter, const QRectF &rect, InteractiveTextFormat::ElementId id,
+                                     const QTextFormat &format)
+{
+    auto it = _rasterCache.find(id);
+    if (it == _rasterCache.end()) {
+        return false;
+    }
+    if (it->format != format || _animations.contains(id)) {
+        // the element has changed since then. animated ones are painted differently on each frame anyway
+        _rasterCache.erase(it);
+        return false;
+    }
+    painter->drawImage(rect.topLeft(), it->image);
+    it->lastUse = ++_rasterUses;
+    return true;
+}
+
+void InteractiveText::rasterizeAhead()
+{
+    if (!_textEdit || _preloadMargin <= 0 || _rasterCacheSize <= 0) {
+        return;
+    }
+    if (_lowDetail) {
+        _rasterTimer->start(); // still scrolling
+        return;
+    }
+
+    QPoint viewportOffset(_textEdit->horizontalScrollBar()->value(), _textEdit->verticalScrollBar()->value());
+    QRect  zone(QPoint(0, 0), _textEdit->viewport()->size());
+    zone.adjust(0, -_preloadMargin, 0, _preloadMargin);
+    zone.translate(viewportOffset);
+
+    auto doc    = _document.data();
+    auto layout = doc->documentLayout();
+    int  from   = layout->hitTest(QPointF(0, qMax(0, zone.top())), Qt::FuzzyHit);
+    int  to     = layout->hitTest(zone.bottomRight(), Qt::FuzzyHit);
+    QITE_STATS_ADD(HitTests, 2);
+    if (from < 0 || to < 0) {
+        return;
+    }
+
+    qreal       dpr    = _textEdit->devicePixelRatioF();
+    int         budget = _rasterCacheSize; // don't evict what was just rendered
+    QTextCursor cursor(doc);
+    cursor.setPosition(from);
+    QString elText(QChar::ObjectReplacementCharacter);
+    while (budget > 0 && !(cursor = doc->find(elText, cursor)).isNull() && cursor.selectionStart() <= to) {
+        QTextCharFormat fmt        = cursor.charFormat();
+        auto            controller = _controllers.value(fmt.objectType());
+        auto            id         = InteractiveTextFormat::id(fmt);
+        if (!controller || _visibleElements.contains(id) || _animations.contains(id)
+            || _rasterInProgress.contains(id)) {
+            continue; // visible ones were painted already
+        }
+        auto cached = _rasterCache.constFind(id);
+        if (cached != _rasterCache.constEnd() && cached->format == fmt) {
+            continue;
+        }
+        auto rasterizer = controller->rasterizer(fmt);
+        auto size       = elementRect(cursor).size();
+        if (!rasterizer || size.isEmpty()) {
+            continue;
+        }
+        budget--;
+        _rasterInProgress.insert(id);
+        _rasterPool->start([this, id, fmt, rasterizer, size, dpr]() {
+            QImage image(size * dpr, QImage::Format_ARGB32_Premultiplied);
+            image.setDevicePixelRatio(dpr);
+            image.fill(Qt::transparent);
+            {
+                QPainter painter(&image);
+                rasterizer(&painter);
+            }
+            QMetaObject::invokeMethod(
+                this, [this, id, fmt, image]() { rasterized(id, fmt, image); }, Qt::QueuedConnection);
+        });
+    }
+}
+
+void InteractiveText::rasterized(InteractiveTextFormat::ElementId id, const QTextFormat &format, const QImage &image)
+{
+    _rasterInProgress.remove(id);
+    if (_rasterCacheSize <= 0 || _visibleElements.contains(id)) {
+        return; // painted the usual way meanwhile
+    }
+    _rasterCache.insert(id, { format, image, ++_rasterUses });
+    trimRasterCache(_rasterCacheSize);
+}
+
+void InteractiveText::animationTick()
+{
+    if (!_textEdit) {
+        return;
+    }
+    auto   now        = frameTime();
+    bool   anyVisible = false;
+    QPoint viewportOffset(_textEdit->horizontalScrollBar()->value(), _textEdit->verticalScrollBar()->value());
+    for (auto it = _animations.cbegin(); it != _animations.cend(); ++it) {
+        if (it->rect.isNull() || !_visibleElements.contains(it.key())) {
+            continue; // off-screen ones cost nothing
+        }
+        anyVisible = true;
+        if (it->controller->animationFrame(it.key(), now)) {
+            _textEdit->viewport()->update(it->rect.translated(-viewportOffset));
+        }
+    }
+    if (!anyVisible) {
+        _frameTimer->stop(); // markVisible restarts it
+    }
+}
 
 // returns rect of the interactive selected (from left to right) element in global coords.
 // So consider coverting into viewport coordinates if needed.
@@ -290,10 +1383,10 @@ QRect InteractiveText::elementRect(const QTextCursor &cursor) const
         if (line.isValid()) {
             // qDebug() << "  line rect" << line.rect();
             auto x = line.cursorToX(posInBlock);
-            auto s = controller->intrinsicSize(_textEdit->document(), anchorCursor.position(), cursor.charFormat());
+            auto s = controller->intrinsicSize(_document, anchorCursor.position(), cursor.charFormat());
             ret    = QRect(QPoint(0, 0), s.toSize());
             ret.moveBottomLeft(QPoint(int(x), int(line.rect().bottom())));
-            ret.translate(_textEdit->document()->documentLayout()->blockBoundingRect(block).topLeft().toPoint());
+            ret.translate(_document->documentLayout()->blockBoundingRect(block).topLeft().toPoint());
         }
     }
     return ret;
@@ -301,14 +1394,21 @@ QRect InteractiveText::elementRect(const QTextCursor &cursor) const
 
 void InteractiveText::trackVisibility()
 {
+    if (!_textEdit) {
+        return;
+    }
+    QITE_STATS_ADD(VisibilityChecks, 1);
+    QITE_STATS_TIMER(TrackVisibility, nullptr);
     // qDebug() << "check visibility";
     QMutableSetIterator<InteractiveTextFormat::ElementId> it(_visibleElements);
     QPoint viewportOffset(_textEdit->horizontalScrollBar()->value(), _textEdit->verticalScrollBar()->value());
     // auto startCursor = _textEdit->cursorForPosition(QPoint(0,0));
     QRect viewPort(QPoint(0, 0), _textEdit->viewport()->size());
+    QRect zone = viewPort.adjusted(0, -_preloadMargin, 0, _preloadMargin);
 
     while (it.hasNext()) {
         auto id = it.next();
+        QITE_STATS_ADD(VisibilityVisited, 1);
 
         // FIXME this call is not optimal. but internally it uses qtextdocument, so it won't slowdoan that much
         auto cursor = findElement(id);
@@ -320,10 +1420,121 @@ void InteractiveText::trackVisibility()
             if (cr.isNull() || !viewPort.intersects(cr)) {
                 auto c = _controllers.value(cursor.charFormat().objectType());
                 if (c) {
-                    c->hideEvent(cursor);
                     it.remove();
+                    if (_preloadMargin > 0 && !cr.isNull() && zone.intersects(cr)) {
+                        // still close. it's hidden by trackProximity once it leaves the zone, so a player keeps
+                        // its pre-roll and an open request isn't cancelled and started again on each viewport edge
+                        if (!_preloadedElements.contains(id)) {
+                            _preloadedElements.insert(id);
+                            c->preloadEvent(cursor);
+                        }
+                    } else {
+                        c->hideEvent(cursor);
+                        _preloadedElements.remove(id); // it's out of the zone, so hide released what was preloaded
+                    }
                 }
             }
         }
     }
+
+    if (_preloadMargin > 0 || !_preloadedElements.isEmpty()) {
+        trackProximity(viewportOffset, viewPort);
+    }
+    if (_preloadMargin > 0 && _rasterCacheSize > 0) {
+        _rasterTimer->start(); // once the view is idle
+    }
 }
+
+void InteractiveText::trackProximity(const QPoint &viewportOffset, const QRect &viewPort)
+{
+    QRect zone = viewPort.adjusted(0, -_preloadMargin, 0, _preloadMargin);
+
+    // release what went too far
+    QMutableSetIterator<InteractiveTextFormat::ElementId> it(_preloadedElements);
+    while (it.hasNext()) {
+        auto id     = it.next();
+        auto cursor = findElement(id);
+        if (cursor.isNull()) {
+            it.remove();
+            continue;
+        }
+        auto cr = elementRect(cursor);
+        cr.translate(-viewportOffset);
+        if (cr.isNull() || !zone.intersects(cr)) {
+            auto c = _controllers.value(cursor.charFormat().objectType());
+            if (c) {
+                c->hideEvent(cursor);
+            }
+            it.remove();
+        }
+    }
+
+    if (_preloadMargin <= 0) {
+        return;
+    }
+
+    // and preload what came close
+    auto   doc    = _document.data();
+    auto   layout = doc->documentLayout();
+    QPoint topLeft(zone.topLeft() + viewportOffset);
+    QPoint bottomRight(zone.bottomRight() + viewportOffset);
+    int    from = layout->hitTest(QPointF(0, qMax(0, topLeft.y())), Qt::FuzzyHit);
+    int    to   = layout->hitTest(bottomRight, Qt::FuzzyHit);
+    QITE_STATS_ADD(HitTests, 2);
+    if (from < 0 || to < 0) {
+        return;
+    }
+
+    QTextCursor cursor(doc);
+    cursor.setPosition(from);
+    QString elText(QChar::ObjectReplacementCharacter);
+    while (!(cursor = doc->find(elText, cursor)).isNull() && cursor.selectionStart() <= to) {
+        QTextCharFormat fmt        = cursor.charFormat();
+        auto            controller = _controllers.value(fmt.objectType());
+        auto            id         = InteractiveTextFormat::id(fmt);
+        if (!controller || _preloadedElements.contains(id)) {
+            continue;
+        }
+        _preloadedElements.insert(id);
+        controller->preloadEvent(cursor);
+    }
+}
+
+//----------------------------------------------------------------------------
+// ITESyncMediaOpenerAdapter
+//----------------------------------------------------------------------------
+ITESyncMediaOpenerAdapter::ITESyncMediaOpenerAdapter(ITEMediaOpener *opener, QObject *parent) :
+    QObject(parent), _opener(opener)
+{
+}
+
+ITEAsyncMediaOpener::RequestId ITESyncMediaOpenerAdapter::openAsync(const QUrl &url, OpenCallback callback)
+{
+    auto requestId = ++_lastRequestId;
+    _pending.insert(requestId);
+    QTimer::singleShot(0, this, [this, requestId, url, callback]() {
+        if (!_pending.remove(requestId)) {
+            return; // cancelled
+        }
+        QUrl openUrl(url); // the opener is allowed to modify it
+        auto dev = _opener->open(openUrl);
+        callback(dev, openUrl);
+    });
+    return requestId;
+}
+
+ITEAsyncMediaOpener::RequestId ITESyncMediaOpenerAdapter::metadataAsync(const QUrl &url, MetadataCallback callback)
+{
+    auto requestId = ++_lastRequestId;
+    _pending.insert(requestId);
+    QTimer::singleShot(0, this, [this, requestId, url, callback]() {
+        if (_pending.remove(requestId)) {
+            callback(_opener->metadata(url));
+        }
+    });
+    return requestId;
+}
+
+void ITESyncMediaOpenerAdapter::cancel(RequestId request) { _pending.remove(request); }
+
+void ITESyncMediaOpenerAdapter::close(QIODevice *dev) { _opener->close(dev); }
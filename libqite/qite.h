@@ -20,12 +20,27 @@ under the License.
 #ifndef QITE_H
 #define QITE_H
 
+#include <QHash>
+#include <QImage>
 #include <QObject>
 #include <QPointer>
+#include <QSet>
+#include <QStaticText>
+#include <QTransform>
+#include <QVector>
 #include <QTextEdit>
 #include <QTextObjectInterface>
 
+#include <functional>
+
+#include "qitestats.h"
+
 class InteractiveText;
+class ITEInputTraceWriter;
+class QDataStream;
+class QIODevice;
+class QThreadPool;
+class QTimer;
 
 #ifndef QITE_FIRST_USER_PROPERTY
 #define QITE_FIRST_USER_PROPERTY 0
@@ -76,48 +91,280 @@ public:
     // subclasses should implement drawITE instead of drawObject
     virtual void drawITE(QPainter *painter, const QRectF &rect, int posInDocument, const QTextFormat &format) = 0;
 
+    // what drawObject recorded in deferred painting mode. see InteractiveText::setDeferredPainting
+    struct DrawCommand {
+        QRectF      rect;
+        int         posInDocument;
+        QTextFormat format;
+    };
+    // draws all the recorded elements of this controller at once. subclasses may reimplement it to set
+    // the painter state once for all the elements. the default implementation calls drawITE for each one
+    virtual void drawITEs(QPainter *painter, const QVector<DrawCommand> &commands);
+
+    typedef std::function<void(QPainter *painter)> Rasterizer;
+
+    // Thread-safe variant of drawITE used to rasterize elements near the viewport ahead of time.
+    // The returned function paints the element at (0, 0) on a worker thread, so it may use only what it captured.
+    // An empty function means the element can't be painted ahead, e.g. drawITE has to query something for it.
+    virtual Rasterizer rasterizer(const QTextFormat &format);
+
+    // Memory accounting. See InteractiveText::memoryUsage. elementMemoryUsage is called for each element of this
+    // controller in the document, the default implementation counts its format as "char formats".
+    // memoryUsage is for the state of the controller itself, the default one counts the staticText() cache.
+    virtual void elementMemoryUsage(ITEMemoryUsage &usage, const QTextFormat &format) const;
+    virtual void memoryUsage(ITEMemoryUsage &usage) const;
+
+    // Snapshots. See InteractiveText::saveSnapshot. Element formats are written with QDataStream, so properties it
+    // can't stream (pointers, custom types) have to be replaced in snapshotFormat and put back in restoreFormat.
+    // saveState is for the controller data worth restoring. Elements get new ids on restore, ids maps the saved ones
+    virtual QTextCharFormat snapshotFormat(const QTextCharFormat &format) const;
+    virtual void            restoreFormat(QTextCharFormat &format);
+    virtual void            saveState(QDataStream &stream) const;
+    virtual void            restoreState(QDataStream &stream, const QHash<quint32, quint32> &ids);
+
+    // One controller may serve many InteractiveText instances (e.g. chat tabs), so its geometry, caches and pools
+    // are shared by all of them. The object type of the elements is the same everywhere. Object types are unique
+    // per process, so it's free in any other InteractiveText unless registered there by hand with that type.
+    // Shared controllers are better not parented to any of them.
+    bool                                           attach(InteractiveText *text);
+    void                                           detach(InteractiveText *text);
+    inline const QList<QPointer<InteractiveText>> &texts() const { return _texts; }
+
 protected:
     friend class InteractiveText;
-    QPointer<InteractiveText> itc;
+    QPointer<InteractiveText> itc; // the first one of texts(). new elements are inserted there
     int                       objectType;
 
+    QTextCursor      findElement(quint32 elementId, int cursorPositionHint = 0); // in any of texts()
+    QTextCursor      findNextElement(const QTextCursor &from);                   // of this controller. same document
+    InteractiveText *textOf(const QTextDocument *document) const;
+    bool             isLowDetail() const; // of the InteractiveText being painted. see InteractiveText::isLowDetail
+
     virtual bool mouseEvent(const Event &event, const QRect &rect, QTextCursor &selected);
     virtual void hideEvent(QTextCursor &selected);
+    virtual void preloadEvent(QTextCursor &selected); // element came close to the viewport. see setPreloadMargin
+    virtual void pageOutEvent(QTextCursor &selected); // element leaves the document. format changes are paged out too
+    // called on each frame of the animation clock for visible animated elements. return true to repaint the element
+    virtual bool animationFrame(quint32 elementId, qint64 frameTime);
+
+    void startAnimation(quint32 elementId); // see InteractiveText::startAnimation
+    void stopAnimation(quint32 elementId);
+
+    // Text elided to the width and laid out once. Painting it doesn't allocate unlike QPainter::drawText.
+    // The result is cached per element till the text, the font or the width changes
+    const QStaticText &staticText(quint32 elementId, const QString &text, const QFont &font, int width);
+    static QStaticText makeStaticText(const QString &text, const QFont &font, int width); // thread-safe
+
+private:
+    struct StaticTextEntry {
+        QString     source; // not elided
+        QFont       font;
+        int         width;
+        QStaticText text;
+        quint64     lastUse;
+    };
+    QHash<quint32, StaticTextEntry> _staticTexts; // element id -> text
+    quint64                         _staticTextUses = 0;
+
+    void forget(InteractiveText *text); // it's being destroyed
+
+    QList<QPointer<InteractiveText>>          _texts;
+    QHash<quint32, QPointer<InteractiveText>> _owners; // element id -> text. only if there are many texts
+    InteractiveText                          *_paintingText = nullptr;
 };
 
 class InteractiveText : public QObject {
     Q_OBJECT
 public:
     InteractiveText(QTextEdit *_textEdit, int baseObjectType = QTextFormat::UserObject);
+    // Widget-less mode for offscreen rendering with render(). Everything tied to a viewport (mouse events,
+    // visibility tracking, preloading, animations and pre-rasterization) is off. The object, the document and
+    // the controllers may live in a worker thread then, see ITEDocumentRenderer.
+    explicit InteractiveText(QTextDocument *document, int baseObjectType = QTextFormat::UserObject,
+                             QObject *parent = nullptr);
     ~InteractiveText();
-    inline QTextEdit *textEdit() const { return _textEdit.data(); }
+    inline QTextEdit     *textEdit() const { return _textEdit.data(); } // nullptr in widget-less mode
+    inline QTextDocument *document() const { return _document.data(); }
+    QFont                 defaultFont() const; // for new elements. the current font of the text edit if any
 
     int                              registerController(InteractiveTextElementController *elementController);
+    bool                             registerController(InteractiveTextElementController *elementController,
+                                                        int objectType); // shared one. see attach
     void                             unregisterController(InteractiveTextElementController *elementController);
     void                             insert(const InteractiveTextFormat &fmt);
     QTextCursor                      findElement(quint32 elementId, int cursorPositionHint = 0);
+    QTextCursor                      findNextElement(const QTextCursor &from, int objectType); // in document order
     void                             markVisible(const InteractiveTextFormat::ElementId &id);
-    InteractiveTextFormat::ElementId nextId();
+    void                             markVisible(const InteractiveTextFormat::ElementId &id, const QRect &docRect);
+    InteractiveTextFormat::ElementId nextId(); // unique across all the instances
+
+    // elements within the margin around the viewport get preloadEvent and hideEvent when they go farther.
+    // with a margin, elements scrolled out of the viewport are hidden only once they leave the margin too
+    void       setPreloadMargin(int pixels);
+    inline int preloadMargin() const { return _preloadMargin; }
+
+    // Shared animation clock. Animated elements get animationFrame() and a repaint of their rect on each display
+    // frame while they are visible. The clock stops when none of them is visible.
+    void          startAnimation(InteractiveTextElementController *controller, InteractiveTextFormat::ElementId id);
+    void          stopAnimation(InteractiveTextFormat::ElementId id);
+    static qint64 frameTime(); // ms. all the instances share the clock
+
+    // When enabled, elements are not painted by the text layout but recorded and painted in one batch at the end
+    // of the viewport paint event, grouped by controller. So they are painted over the text cursor and selection.
+    inline void setDeferredPainting(bool deferred = true) { _deferredPainting = deferred; }
+    inline bool deferredPainting() const { return _deferredPainting; }
+
+    // While the view scrolls faster than this, isLowDetail() is true and controllers are expected to draw
+    // a cheap placeholder. Everything visible is repainted in full detail once scrolling settles. 0 disables it.
+    inline void setFastScrollSpeed(int pixelsPerSecond) { _fastScrollSpeed = pixelsPerSecond; }
+    inline bool isLowDetail() const { return _lowDetail; }
+
+    // When the view is idle, elements within the preload margin are rasterized on a worker thread (see
+    // InteractiveTextElementController::rasterizer), so their first paint is just a copy of the image.
+    // Up to count images are kept. 0 disables it.
+    void setRasterCacheSize(int count);
+
+    // Estimated memory held for the elements of the document by this object and the controllers.
+    // Walks the whole document, so it's for debugging and benchmarks. See ITEMemoryUsage::dump
+    ITEMemoryUsage memoryUsage() const;
+
+    // History windowing for long-lived documents. Once there are more than blocks + pageBlocks blocks, the oldest
+    // pageBlocks ones far enough above the viewport are cut into a page kept without layout, and put back when the
+    // view comes near the top. Elements keep their ids and formats, controllers get pageOutEvent before they leave.
+    // Only blocks and char formats are kept, so tables and lists are flattened. Each page move clears the undo
+    // stack. 0 disables it and pages everything back in
+    void       setHistoryWindow(int blocks, int pageBlocks = 50);
+    inline int historyWindow() const { return _historyWindow; }
+    inline int pagedOutPages() const { return _historyPages.size(); }
+    bool       pageInHistory(); // puts back the newest paged out page. false if there is none
+
+    // Binary snapshot of the document with the paged out history, element formats and controller data.
+    // Restore replaces the content with one bulk insert (with history windowing only the newest page is inserted).
+    // The current elements are paged out first. Elements of controllers not registered now become plain objects.
+    // Controllers are saved in the order of registration and mapped back by class name and that order, so the n-th
+    // registered controller of a class gets the state and the elements of the n-th saved one.
+    // Layout (QDataStream): QByteArray magic ("QITESNAP"), quint32 version,
+    //   quint32 count, count * { qint32 objectType, QByteArray controller class, QByteArray controller state },
+    //   quint32 count, count * page { quint32 count, count * QTextFormat, quint32 count, count * block { qint32
+    //   blockFormat, qint32 charFormat, qint32 runs }, quint32 count, count * run { qint32 length, qint32 format },
+    //   QString text }
+    bool saveSnapshot(QIODevice *device) const;
+    bool restoreSnapshot(QIODevice *device); // false if the snapshot is broken. the document is intact then
+
+    // Records the hover and mouse events seen by the event filter, scroll positions and resizes with their timing
+    // to the device, so the interaction can be replayed with ITEInputReplayer. See qitetrace.h.
+    // The device has to stay open while recording and isn't owned. nullptr stops recording
+    void setInputTrace(QIODevice *device);
+
+    // Paints the document and its elements like QTextDocument::drawContents, honoring deferredPainting().
+    // The clip rect is in document coordinates. Meant for the widget-less mode
+    void render(QPainter *painter, const QRectF &clip = QRectF());
 
 protected:
     bool eventFilter(QObject *obj, QEvent *event);
 
 private:
+    friend class InteractiveTextElementController;
+    struct DeferredDraw {
+        InteractiveTextElementController             *controller;
+        QTransform                                    transform;
+        InteractiveTextElementController::DrawCommand command;
+    };
+
+    // a part of the document without layout. see setHistoryWindow
+    struct HistoryPage {
+        struct Block {
+            int blockFormat; // indexes in formats
+            int charFormat;
+            int runs; // amount of the runs in the block
+        };
+        struct Run {
+            int length;
+            int format;
+        };
+        QString              text;    // of all the runs
+        QVector<QTextFormat> formats; // deduplicated
+        QVector<Block>       blocks;
+        QVector<Run>         runs;
+    };
+
+    void  init();
     void  checkAndGenerateLeaveEvent(QEvent *event);
     QRect elementRect(const QTextCursor &selected) const;
+    void  trackProximity(const QPoint &viewportOffset, const QRect &viewPort);
+    void  flushDeferredDraws(QPainter *painter);
+    bool  drawRasterized(QPainter *painter, const QRectF &rect, InteractiveTextFormat::ElementId id,
+                         const QTextFormat &format);
+    void  rasterized(InteractiveTextFormat::ElementId id, const QTextFormat &format, const QImage &image);
+    void  trimRasterCache(int count); // drops least recently used images
+    void  pageOutHistory(int blockCount);
+    void  pageOutElements(int endPosition); // controllers release what they hold for elements before the position
+
+    HistoryPage makeHistoryPage(const QTextBlock &begin, const QTextBlock &end) const;
+    void        insertHistoryPage(QTextCursor &cursor, const HistoryPage &page); // at the start of an empty block
+    void        writeHistoryPage(QDataStream &stream, const HistoryPage &page) const;
+    bool        readHistoryPage(QDataStream &stream, HistoryPage &page, const QHash<int, int> &types,
+                                QHash<quint32, quint32> &ids); // types and ids are saved -> current
 private slots:
     void trackVisibility();
+    void animationTick();
+    void scrolled();
+    void scrollSettled();
+    void rasterizeAhead();
+    void updateHistoryWindow();
 
 private:
     QPointer<QTextEdit>                           _textEdit;
-    int                                           _baseObjectType;
-    int                                           _objectType;
-    quint32                                       _uniqueElementId = 0;    // just a sequence number
+    QPointer<QTextDocument>                       _document;
+    int                                           _baseObjectType;         // lower bound for registerController
     quint32                                       _lastElementId;          // last which had mouse event
     int                                           _lastCursorPositionHint; // wrt mouse event
     QMap<int, InteractiveTextElementController *> _controllers;
+    QList<InteractiveTextElementController *>     _controllersOrder; // in the order of registration. see snapshots
     QSet<InteractiveTextFormat::ElementId>        _visibleElements;
+    QSet<InteractiveTextFormat::ElementId>        _preloadedElements;
+    int                                           _preloadMargin    = 0;
     bool                                          _lastMouseHandled = false;
+
+    struct Animation {
+        InteractiveTextElementController *controller = nullptr;
+        QRect                             rect; // in document coordinates. null until the element is painted
+    };
+    QHash<InteractiveTextFormat::ElementId, Animation> _animations;
+    QTimer                                            *_frameTimer = nullptr;
+
+    QVector<DeferredDraw>                                  _deferredDraws; // reused, so the capacity stays
+    QVector<InteractiveTextElementController::DrawCommand> _drawGroup;
+    bool                                                   _deferredPainting = false;
+    bool                                                   _recordingDraws   = false; // inside viewport paint event
+
+    // scroll velocity tracking
+    QTimer *_settleTimer     = nullptr;
+    QPoint  _lastScrollValue;
+    qint64  _lastScrollTime  = 0; // frameTime()
+    int     _fastScrollSpeed = 4000;
+    bool    _lowDetail       = false;
+
+    // pre-rasterized elements
+    struct RasterEntry {
+        QTextFormat format; // the image is valid while the element has the same format
+        QImage      image;
+        quint64     lastUse = 0; // _rasterUses. a stamp instead of a list, so a paint doesn't reorder anything
+    };
+    QHash<InteractiveTextFormat::ElementId, RasterEntry> _rasterCache;
+    QSet<InteractiveTextFormat::ElementId>               _rasterInProgress;
+    QThreadPool                                         *_rasterPool      = nullptr;
+    QTimer                                              *_rasterTimer     = nullptr;
+    int                                                  _rasterCacheSize = 32;
+    quint64                                              _rasterUses      = 0;
+
+    ITEInputTraceWriter *_inputTrace = nullptr;
+
+    // paged out history
+    QList<HistoryPage> _historyPages; // oldest first
+    QTimer            *_historyTimer      = nullptr;
+    int                _historyWindow     = 0;
+    int                _historyPageBlocks = 50;
 };
 
 class ITEMediaOpener {
@@ -127,4 +374,40 @@ public:
     virtual QVariant   metadata(const QUrl &url) = 0;
 };
 
+// Asynchronous version of ITEMediaOpener for openers which may take a while (decryption, network etc).
+// Callbacks have to be invoked in the thread which made the request and never after the request was cancelled.
+class ITEAsyncMediaOpener {
+public:
+    typedef quint32 RequestId;
+    // the device is nullptr if failed to open. the url is what to play it as, the opener may have redirected it
+    typedef std::function<void(QIODevice *dev, const QUrl &url)> OpenCallback;
+    typedef std::function<void(const QVariant &)>                MetadataCallback; // invalid variant if no metadata
+
+    virtual ~ITEAsyncMediaOpener() = default;
+
+    virtual RequestId openAsync(const QUrl &url, OpenCallback callback)         = 0;
+    virtual RequestId metadataAsync(const QUrl &url, MetadataCallback callback) = 0;
+    virtual void      cancel(RequestId request)                                 = 0;
+    virtual void      close(QIODevice *dev)                                     = 0;
+};
+
+// Serves a synchronous opener through the asynchronous interface.
+// The opener is still called in the GUI thread, but on next event loop iteration and so out of paint and mouse events
+class ITESyncMediaOpenerAdapter : public QObject, public ITEAsyncMediaOpener {
+public:
+    explicit ITESyncMediaOpenerAdapter(ITEMediaOpener *opener, QObject *parent = nullptr);
+
+    inline ITEMediaOpener *opener() const { return _opener; }
+
+    RequestId openAsync(const QUrl &url, OpenCallback callback);
+    RequestId metadataAsync(const QUrl &url, MetadataCallback callback);
+    void      cancel(RequestId request);
+    void      close(QIODevice *dev);
+
+private:
+    ITEMediaOpener *_opener;
+    RequestId       _lastRequestId = 0;
+    QSet<RequestId> _pending;
+};
+
 #endif // QITE_H
@@ -18,24 +18,34 @@ under the License.
 */
 
 #include "qiteaudio.h"
+#include "qitehistogram.h"
+#include "qitereadahead.h"
+#include "qitestats.h"
 
-#include <QAudioOutput>
+#include <QBuffer>
+#include <QDataStream>
+#include <QDebug>
 #include <QEvent>
 #include <QFile>
 #include <QHoverEvent>
-#include <QMediaMetaData>
-#include <QMediaPlayer>
 #include <QNetworkAccessManager>
 #include <QNetworkReply>
 #include <QPainter>
+#include <QSignalBlocker>
 #include <QTextEdit>
 #include <QTimer>
 #include <QVector2D>
 #include <QtGlobal>
+#include <algorithm>
+#include <memory>
+#include <utility>
 
 // #define QITE_DEBUG
 
 namespace {
+const int    ProgressNotifyInterval   = 250;  // ms. position reports of a playing player
+const qint64 MaxProgressExtrapolation = 1000; // ms. don't run away from a stalled player
+
 ITEAudioController::Histogram histogramFromDevice(QIODevice *dev)
 {
     ITEAudioController::Histogram hm;
@@ -47,6 +57,33 @@ ITEAudioController::Histogram histogramFromDevice(QIODevice *dev)
     }
     return hm;
 }
+
+ITEAudioController::Histogram histogramFromBytes(const QByteArray &compressed)
+{
+    ITEAudioController::Histogram hm;
+    hm.reserve(compressed.size());
+    for (auto v : compressed) {
+        hm.push_back(quint8(v) / 256.0f);
+    }
+    return hm;
+}
+
+bool isTitle(const QVariant &metadata)
+{
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    return metadata.type() == QVariant::String;
+#else
+    return metadata.typeId() == QMetaType::QString;
+#endif
+}
+
+qint64 histogramBytes(const QVariant &metadata)
+{
+    if (metadata.userType() != qMetaTypeId<ITEAudioController::Histogram>()) {
+        return 0;
+    }
+    return ITEMemoryUsage::DataHeader + metadata.value<ITEAudioController::Histogram>().size() * qint64(sizeof(float));
+}
 }
 
 class AudioMessageFormat : public InteractiveTextFormat {
@@ -57,12 +94,13 @@ public:
         PlayPosition, /* in pixels */
         State,
         MetadataState,
-        Metadata
+        Metadata,
+        AsyncMediaOpener
     };
 
     enum MDState { NotRequested, RequestInProgress, Finished };
 
-    enum Flag { Playing = 0x1, MouseOnButton = 0x2, MouseOnTrackbar = 0x4 };
+    enum Flag { Playing = 0x1, MouseOnButton = 0x2, MouseOnTrackbar = 0x4, Opening = 0x8 };
     Q_DECLARE_FLAGS(Flags, Flag)
 
     using InteractiveTextFormat::InteractiveTextFormat;
@@ -75,8 +113,10 @@ public:
     quint32 playPosition() const;
     void    setPlayPosition(quint32 position);
 
-    QUrl            url() const;
-    ITEMediaOpener *mediaOpener() const;
+    QUrl                 url() const;
+    ITEMediaOpener      *mediaOpener() const;
+    ITEAsyncMediaOpener *asyncMediaOpener() const;
+    void                 setAsyncMediaOpener(ITEAsyncMediaOpener *opener);
 
     QVariant metaData() const;
     void     setMetaData(const QVariant &v);
@@ -118,6 +158,16 @@ ITEMediaOpener *AudioMessageFormat::mediaOpener() const
     return static_cast<ITEMediaOpener *>(property(AudioMessageFormat::MediaOpener).value<void *>());
 }
 
+ITEAsyncMediaOpener *AudioMessageFormat::asyncMediaOpener() const
+{
+    return static_cast<ITEAsyncMediaOpener *>(property(AudioMessageFormat::AsyncMediaOpener).value<void *>());
+}
+
+void AudioMessageFormat::setAsyncMediaOpener(ITEAsyncMediaOpener *opener)
+{
+    setProperty(AudioMessageFormat::AsyncMediaOpener, QVariant::fromValue<void *>(opener));
+}
+
 QVariant AudioMessageFormat::metaData() const { return property(AudioMessageFormat::Metadata); }
 
 void AudioMessageFormat::setMetaData(const QVariant &v)
@@ -148,15 +198,15 @@ QSizeF ITEAudioController::intrinsicSize(QTextDocument *doc, int posInDocument,
 #endif
     if (lastFontSize != psize) {
         lastFontSize = psize;
-        updateGeomtry();
+        geometry.update(psize);
     }
-    return elementSize;
+    return geometry.elementSize;
 }
 
-void ITEAudioController::updateGeomtry()
+void ITEAudioController::Geometry::update(int fontHeight)
 {
     // compute geomtry of player
-    baseSize           = lastFontSize / 12.0;
+    baseSize           = fontHeight / 12.0;
     int elementPadding = int(baseSize * 4);
 
     bgOutlineWidth = baseSize < 2 ? 2 : int(baseSize);
@@ -197,37 +247,220 @@ void ITEAudioController::updateGeomtry()
     scaleRect     = QRectF(scaleTopLeft, scaleBottomRight);
     scaleFillRect = scaleRect.adjusted(scaleOutlineWidth / 2, scaleOutlineWidth / 2, -scaleOutlineWidth / 2,
                                        -scaleOutlineWidth / 2);
+
+    // painting with ready pens and brushes doesn't allocate anything
+    bgPen = QPen(QColor(100, 200, 100)); // TODO name all the magic colors
+    bgPen.setWidth(bgOutlineWidth);
+    bgBrush          = QBrush(QColor(150, 250, 150));
+    buttonBrush      = QBrush(QColor(120, 220, 120));
+    buttonHoverBrush = QBrush(QColor(130, 230, 130));
+    signPen          = QPen(QColor(Qt::white));
+    signPen.setWidth(bgOutlineWidth);
+    signBrush = QBrush(QColor(Qt::white));
+    scalePen  = QPen(QColor(100, 200, 100));
+    scalePen.setWidth(scaleOutlineWidth);
+    playedBrush = QBrush(QColor(170, 255, 170));
+    metadataPen = QPen(QColor(70, 150, 70));
 }
 
 void ITEAudioController::drawITE(QPainter *painter, const QRectF &rect, int posInDocument, const QTextFormat &format)
+{
+    if (isLowDetail()) {
+        painter->fillRect(geometry.bgRect.translated(int(rect.left()), int(rect.top())), geometry.bgBrush);
+        return; // fast scrolling. it will be repainted once settled
+    }
+    painter->setRenderHints(QPainter::Antialiasing);
+    geometry.setBackgroundStyle(painter);
+    geometry.drawBackground(painter, rect);
+    drawControls(painter, rect, posInDocument, format);
+}
+
+void ITEAudioController::drawITEs(QPainter *painter, const QVector<DrawCommand> &commands)
+{
+    if (isLowDetail()) {
+        for (auto const &c : commands) {
+            painter->fillRect(geometry.bgRect.translated(int(c.rect.left()), int(c.rect.top())), geometry.bgBrush);
+        }
+        return;
+    }
+    // all the backgrounds share the same style. so draw them first and then the rest element by element
+    painter->setRenderHints(QPainter::Antialiasing);
+    geometry.setBackgroundStyle(painter);
+    for (auto const &c : commands) {
+        geometry.drawBackground(painter, c.rect);
+    }
+    for (auto const &c : commands) {
+        drawControls(painter, c.rect, c.posInDocument, c.format);
+    }
+}
+
+InteractiveTextElementController::Rasterizer ITEAudioController::rasterizer(const QTextFormat &format)
+{
+    auto audioFormat = AudioMessageFormat::fromCharFormat(format.toCharFormat());
+    if (audioFormat.metaDataState() == AudioMessageFormat::NotRequested || progress.contains(audioFormat.id())
+        || QFontMetrics(audioFormat.font()).height() != lastFontSize || !geometry.hasTitleFont) {
+        return Rasterizer(); // drawITE has something to do besides painting or the geometry isn't known yet
+    }
+    // the geometry and the format are copied. so it doesn't matter if they change meanwhile
+    return [g = geometry, audioFormat](QPainter *painter) {
+        QRectF rect(QPointF(0, 0), g.elementSize);
+        auto   metadata = audioFormat.metaData();
+        painter->setFont(g.titleFont); // the image painter has the application font, not the text edit's one
+        auto title = makeStaticText(isTitle(metadata) ? metadata.toString() : QString(), g.titleFont,
+                                    g.metaRect.width());
+        painter->setRenderHints(QPainter::Antialiasing);
+        g.setBackgroundStyle(painter);
+        g.drawBackground(painter, rect);
+        g.paint(painter, rect, audioFormat, audioFormat.playPosition(), title);
+    };
+}
+
+void ITEAudioController::elementMemoryUsage(ITEMemoryUsage &usage, const QTextFormat &format) const
+{
+    InteractiveTextElementController::elementMemoryUsage(usage, format);
+    auto bytes = histogramBytes(format.property(AudioMessageFormat::Metadata));
+    if (bytes) {
+        usage.addElement(QLatin1String("histograms"), InteractiveTextFormat::id(format), bytes);
+    }
+}
+
+void ITEAudioController::memoryUsage(ITEMemoryUsage &usage) const
+{
+    InteractiveTextElementController::memoryUsage(usage);
+
+    // decoders and outputs of the backend are not known. read-ahead buffers are ours
+    const auto playerBytes = ITEMemoryUsage::nodesBytes(1, sizeof(quint32) + sizeof(ITEAudioPlayer *));
+    for (auto it = activePlayers.constBegin(); it != activePlayers.constEnd(); ++it) {
+        bool readAhead = it.value()->property("readAhead").value<void *>();
+        usage.addElement(QLatin1String("players"), it.key(), playerBytes + (readAhead ? readAheadSize : 0));
+    }
+    usage.add(QLatin1String("spare players"), sparePlayers.size() * qint64(sizeof(ITEAudioPlayer *)),
+              sparePlayers.size());
+    for (auto it = progress.constBegin(); it != progress.constEnd(); ++it) {
+        usage.addElement(QLatin1String("playback state"), it.key(),
+                         ITEMemoryUsage::nodesBytes(1, sizeof(quint32) + sizeof(Progress)));
+    }
+    for (auto it = evictedPositions.constBegin(); it != evictedPositions.constEnd(); ++it) {
+        usage.addElement(QLatin1String("playback state"), it.key(),
+                         ITEMemoryUsage::nodesBytes(1, sizeof(quint32) + sizeof(qint64)));
+    }
+
+    // pending replies. waiters share the url with their request
+    const auto waiterBytes = ITEMemoryUsage::nodesBytes(1, sizeof(QUrl) + sizeof(QPair<quint32, int>));
+    for (auto it = metadataRequests.constBegin(); it != metadataRequests.constEnd(); ++it) {
+        usage.add(QLatin1String("pending metadata"),
+                  ITEMemoryUsage::nodesBytes(1, sizeof(QUrl) + sizeof(it.value()))
+                      + ITEMemoryUsage::stringBytes(it.key().toString()));
+    }
+    for (auto it = metadataWaiters.constBegin(); it != metadataWaiters.constEnd(); ++it) {
+        usage.addElement(QLatin1String("pending metadata"), it->first, waiterBytes);
+    }
+    for (auto it = histogramWaiters.constBegin(); it != histogramWaiters.constEnd(); ++it) {
+        usage.addElement(QLatin1String("pending histograms"), it->first, waiterBytes);
+    }
+
+    for (auto it = metadataCache.constBegin(); it != metadataCache.constEnd(); ++it) {
+        auto const &metadata = it->metadata;
+        usage.add(QLatin1String("metadata cache"),
+                  ITEMemoryUsage::nodesBytes(1, sizeof(QUrl) + sizeof(MetadataCacheEntry))
+                      + ITEMemoryUsage::stringBytes(it.key().toString()) + ITEMemoryUsage::variantBytes(metadata)
+                      + histogramBytes(metadata.toMap().value(QLatin1String("amplitudes"))));
+    }
+    if (histogramGenerator) {
+        usage.add(QLatin1String("generated histograms"), histogramGenerator->cacheBytes(),
+                  histogramGenerator->cacheSize());
+    }
+    if (!histogramStore.isEmpty()) {
+        usage.add(QLatin1String("histogram store"), histogramStore.bytes(), histogramStore.size());
+    }
+}
+
+void ITEAudioController::drawControls(QPainter *painter, const QRectF &rect, int posInDocument,
+                                      const QTextFormat &format)
 {
     const AudioMessageFormat audioFormat = AudioMessageFormat::fromCharFormat(format.toCharFormat());
     // qDebug() << audioFormat.id();
 
-    painter->setRenderHints(QPainter::Antialiasing);
+    // check metadata. maybe it's ready or we need to query it
+    auto mdState = audioFormat.metaDataState();
+    if (mdState == AudioMessageFormat::NotRequested) {
+        auto url               = audioFormat.url();
+        bool hasOpener         = audioFormat.mediaOpener() || audioFormat.asyncMediaOpener();
+        bool canFetchOrCompute = (autoFetchMetadata && url.path().endsWith(".mp4"))
+            || (autoGenerateHistogram && url.isLocalFile());
+        // we use mp4 for audio messages. so it may have amplitudes. For local files we can compute them ourselves.
+        if (hasOpener || canFetchOrCompute) {
+            auto id = audioFormat.id();
+            // use deleayed call since it's not that good to chage docs from drawing func.
+            QTimer::singleShot(0, this, [this, id, posInDocument]() {
+                QTextCursor cursor = findElement(id, posInDocument);
+                if (cursor.isNull()) {
+                    return; // was deleted so quickly?
+                }
+                auto audioFormat = AudioMessageFormat::fromCharFormat(cursor.charFormat());
+                if (audioFormat.metaDataState() != AudioMessageFormat::NotRequested) {
+                    return; // likely duplicate query, while previous one wasn't finished it.
+                }
+                queryMetadata(cursor, audioFormat);
+            });
+        }
+    }
 
-    QPen bgPen(QColor(100, 200, 100)); // TODO name all the magic colors
-    bgPen.setWidth(bgOutlineWidth);
+    // played part
+    auto playPos = audioFormat.playPosition();
+    auto pit     = progress.find(audioFormat.id());
+    if (pit != progress.end()) {
+        // the player reports position rarely. extrapolate it to the current frame but not too far
+        auto elapsed    = qBound(qint64(0), itc->frameTime() - pit->time, MaxProgressExtrapolation);
+        playPos         = pixelPosition(qMin(pit->position + elapsed, pit->duration), pit->duration);
+        pit->drawnPixel = playPos;
+    }
+
+    if (!geometry.hasTitleFont || geometry.titleFont != painter->font()) {
+        geometry.titleFont    = painter->font();
+        geometry.hasTitleFont = true;
+    }
+
+    static const QStaticText noTitle;
+    auto                     metadata = audioFormat.metaData();
+    geometry.paint(painter, rect, audioFormat, playPos,
+                   isTitle(metadata) ? staticText(audioFormat.id(), metadata.toString(), painter->font(),
+                                                  geometry.metaRect.width())
+                                     : noTitle);
+}
+
+void ITEAudioController::Geometry::setBackgroundStyle(QPainter *painter) const
+{
     painter->setPen(bgPen);
-    painter->setBrush(QColor(150, 250, 150));
+    painter->setBrush(bgBrush);
+}
+
+void ITEAudioController::Geometry::drawBackground(QPainter *painter, const QRectF &rect) const
+{
     painter->drawRoundedRect(bgRect.translated(int(rect.left()), int(rect.top())), bgRectRadius, bgRectRadius);
+}
+
+void ITEAudioController::Geometry::paint(QPainter *painter, const QRectF &rect, const AudioMessageFormat &audioFormat,
+                                         quint32 playPos, const QStaticText &title) const
+{
+    auto state = audioFormat.state();
 
     // draw button
-    if (audioFormat.state() & AudioMessageFormat::MouseOnButton) {
-        painter->setBrush(QColor(130, 230, 130));
-    } else {
-        painter->setBrush(QColor(120, 220, 120));
-    }
+    painter->setBrush(state & AudioMessageFormat::MouseOnButton ? buttonHoverBrush : buttonBrush);
     auto xBtnCenter = btnCenter + rect.topLeft();
     painter->drawEllipse(xBtnCenter, btnRadius, btnRadius);
 
     // draw pause/play
-    QPen signPen((QColor(Qt::white)));
-    signPen.setWidth(bgOutlineWidth);
     painter->setPen(signPen);
-    painter->setBrush(QColor(Qt::white));
-    bool isPlaying = audioFormat.state() & AudioMessageFormat::Playing;
-    if (isPlaying) {
+    painter->setBrush(signBrush);
+    bool isPlaying = state & AudioMessageFormat::Playing;
+    if (state & AudioMessageFormat::Opening) {
+        // the media is still being opened. draw an open ring instead of the sign
+        painter->setBrush(Qt::NoBrush);
+        QRectF ring(0, 0, signSize * 2, signSize * 2);
+        ring.moveCenter(xBtnCenter);
+        painter->drawArc(ring, 90 * 16, -270 * 16);
+    } else if (isPlaying) {
         QRectF bar(0, 0, signSize / 3, signSize * 2);
         bar.moveCenter(xBtnCenter - QPointF(signSize / 2, 0));
         painter->drawRect(bar);
@@ -240,107 +473,28 @@ void ITEAudioController::drawITE(QPainter *painter, const QRectF &rect, int posI
     }
 
     // draw scale
-    QPen scalePen(QColor(100, 200, 100));
-    scalePen.setWidth(scaleOutlineWidth);
     painter->setPen(scalePen);
-    painter->setBrush(QColor(120, 220, 120));
+    painter->setBrush(buttonBrush);
     QRectF xScaleRect(scaleRect.translated(rect.topLeft()));
     painter->drawRoundedRect(xScaleRect, scaleRect.height() / 2, scaleRect.height() / 2);
 
     // draw played part
-    auto playPos = audioFormat.playPosition();
     if (playPos) {
         painter->setPen(Qt::NoPen);
-        painter->setBrush(QColor(170, 255, 170));
+        painter->setBrush(playedBrush);
         QRectF playedRect(scaleFillRect.translated(rect.topLeft())); // to the width of the scale border
         playedRect.setWidth(playPos);
         painter->drawRoundedRect(playedRect, playedRect.height() / 2, playedRect.height() / 2);
     }
 
-    // check metadata. maybe it's ready or we need to query it
-    auto mdState = audioFormat.metaDataState();
-    if (mdState != AudioMessageFormat::Finished) {
-
-        auto opener = audioFormat.mediaOpener();
-        if (opener) {
-            QVariant metadata = opener->metadata(audioFormat.url());
-            if (metadata.isValid()) {
-                auto id = audioFormat.id();
-                QTimer::singleShot(0, this, [this, id, posInDocument, metadata]() {
-                    QTextCursor cursor = itc->findElement(id, posInDocument);
-                    if (cursor.isNull())
-                        return; // was deleted so quickly?
-
-                    auto audioFormat = AudioMessageFormat::fromCharFormat(cursor.charFormat());
-                    if (audioFormat.metaDataState() == AudioMessageFormat::Finished)
-                        return;
-
-                    QVariantMap vm = metadata.toMap();
-                    audioFormat.setMetaData(vm.value(QLatin1String("amplitudes")));
-                    audioFormat.setMetaDataState(AudioMessageFormat::Finished);
-                    cursor.setCharFormat(audioFormat);
-                });
-            }
-        }
-
-        if (!autoFetchMetadata || mdState == AudioMessageFormat::RequestInProgress) {
-            return;
-        }
-
-        // we need t query amplitudes. Let's check if it makes sense first.
-        if (audioFormat.url().path().endsWith(".mp4")) { // we use mp4 for audio messages. so it may have amplitudes
-            auto id = audioFormat.id();
-            // use deleayed call since it's not that good to chage docs from drawing func.
-            QTimer::singleShot(0, this, [this, id, posInDocument]() {
-                QTextCursor cursor = itc->findElement(id, posInDocument);
-                if (cursor.isNull()) {
-                    return; // was deleted so quickly?
-                }
-                auto audioFormat = AudioMessageFormat::fromCharFormat(cursor.charFormat());
-                if (audioFormat.metaDataState() != AudioMessageFormat::NotRequested) {
-                    return; // likely duplicate query, while previous one wasn't finished it.
-                }
-
-                // time to query amplitudes file
-                if (!nam) {
-                    nam = new QNetworkAccessManager(this);
-                }
-                QUrl metaUrl(audioFormat.url());
-                metaUrl.setPath(metaUrl.path() + ".amplitudes");
-                if (metaUrl.isLocalFile()) {
-                    QFile file(metaUrl.toLocalFile());
-                    if (file.open(QIODevice::ReadOnly)) {
-                        audioFormat.setMetaData(QVariant::fromValue<Histogram>(histogramFromDevice(&file)));
-                        cursor.setCharFormat(audioFormat);
-                    }
-                    return;
-                }
-                auto reply = nam->get(QNetworkRequest(metaUrl));
-                audioFormat.setMetaDataState(AudioMessageFormat::RequestInProgress);
-                cursor.setCharFormat(audioFormat);
-                auto pos = cursor.anchor();
-                connect(reply, &QNetworkReply::finished, this, [this, id, pos, reply]() {
-                    QTextCursor cursor = itc->findElement(id, pos);
-                    if (!cursor.isNull()) {
-                        auto afmt = AudioMessageFormat::fromCharFormat(cursor.charFormat());
-                        afmt.setMetaData(QVariant::fromValue<Histogram>(histogramFromDevice(reply)));
-                        cursor.setCharFormat(afmt);
-                    }
-                    reply->close();
-                    reply->deleteLater();
-                });
-            });
-        }
-    }
-
     auto hg = audioFormat.metaData();
     if (hg.canConvert<QList<float>>()) {
-        // amplitudes
-        auto hglist    = hg.value<QList<float>>();
-        auto step      = metaRect.width() / float(hglist.size());
-        auto tmetaRect = metaRect.translated(rect.topLeft().toPoint());
-        painter->setPen(QColor(70, 150, 70));
-        painter->setBrush(QColor(120, 220, 120));
+        // amplitudes. const, so indexing doesn't detach the list shared with the format
+        const auto hglist    = hg.value<QList<float>>();
+        auto       step      = metaRect.width() / float(hglist.size());
+        auto       tmetaRect = metaRect.translated(rect.topLeft().toPoint());
+        painter->setPen(metadataPen);
+        painter->setBrush(buttonBrush);
         for (int i = 0; i < hglist.size(); i++) { // values from 0 to 1.0 (including)
             int left   = int(i * step);
             int right  = int((i + 1) * step);
@@ -352,24 +506,24 @@ void ITEAudioController::drawITE(QPainter *painter, const QRectF &rect, int posI
                 painter->drawRect(hcolRect);
             }
         }
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-    } else if (hg.type() == QVariant::String) {
-#else
-    } else if (hg.typeId() == QMetaType::QString) {
-#endif
-        painter->setPen(QColor(70, 150, 70));
-        painter->drawText(metaRect.translated(rect.topLeft().toPoint()), hg.toString());
+    } else if (isTitle(hg)) {
+        painter->setPen(metadataPen);
+        painter->drawStaticText(metaRect.translated(rect.topLeft().toPoint()).topLeft(), title);
     }
-
-    // runner
-    // QRectF runnerRect(playedRect);
-    // runnerRect.set
 }
 
 QTextCharFormat ITEAudioController::makeFormat(const QUrl &audioSrc, ITEMediaOpener *mediaOpener) const
 {
     AudioMessageFormat fmt(objectType, itc->nextId(), audioSrc, mediaOpener);
-    fmt.setFontPointSize(itc->textEdit()->currentFont().pointSize());
+    fmt.setFontPointSize(itc->defaultFont().pointSize());
+    return fmt;
+}
+
+QTextCharFormat ITEAudioController::makeFormat(const QUrl &audioSrc, ITEAsyncMediaOpener *mediaOpener) const
+{
+    AudioMessageFormat fmt(objectType, itc->nextId(), audioSrc);
+    fmt.setAsyncMediaOpener(mediaOpener);
+    fmt.setFontPointSize(itc->defaultFont().pointSize());
     return fmt;
 }
 
@@ -379,15 +533,39 @@ void ITEAudioController::insert(const QUrl &audioSrc, ITEMediaOpener *mediaOpene
     itc->insert(static_cast<InteractiveTextFormat>(fmt));
 }
 
+void ITEAudioController::insert(const QUrl &audioSrc, ITEAsyncMediaOpener *mediaOpener)
+{
+    auto fmt = makeFormat(audioSrc, mediaOpener);
+    itc->insert(static_cast<InteractiveTextFormat>(fmt));
+}
+
+ITEAsyncMediaOpener *ITEAudioController::asyncOpener(const AudioMessageFormat &format)
+{
+    auto opener = format.asyncMediaOpener();
+    if (opener) {
+        return opener;
+    }
+    auto syncOpener = format.mediaOpener();
+    if (!syncOpener) {
+        return nullptr;
+    }
+    auto adapter = syncOpeners.value(syncOpener);
+    if (!adapter) {
+        adapter = new ITESyncMediaOpenerAdapter(syncOpener, this);
+        syncOpeners.insert(syncOpener, adapter);
+    }
+    return adapter;
+}
+
 bool ITEAudioController::mouseEvent(const Event &event, const QRect &rect, QTextCursor &selected)
 {
     Q_UNUSED(rect);
     bool onButton   = false;
     bool onTrackbar = false;
     if (event.type != EventType::Leave) {
-        onButton = isOnButton(event.pos, bgRect);
+        onButton = isOnButton(event.pos, geometry.bgRect);
         if (!onButton) {
-            onTrackbar = scaleRect.contains(event.pos);
+            onTrackbar = geometry.scaleRect.contains(event.pos);
         }
     }
     if (onButton || onTrackbar) {
@@ -417,177 +595,48 @@ bool ITEAudioController::mouseEvent(const Event &event, const QRect &rect, QText
             state ^= AudioMessageFormat::Playing;
             auto player = activePlayers.value(playerId);
             if (state & AudioMessageFormat::Playing) {
+                latencyProbe.start(playerId, ClickStage);
                 if (!player) {
-                    player = new QMediaPlayer(this);
-#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
-                    player->setAudioOutput(new QAudioOutput(player));
-#endif
-                    player->setProperty("playerId", playerId);
-                    player->setProperty("cursorPos", selected.anchor());
-                    activePlayers.insert(playerId, player);
-                    ITEMediaOpener *opener = format.mediaOpener();
-                    QUrl            url    = format.url();
-                    QIODevice      *stream = opener ? opener->open(url) : nullptr;
-                    if (stream)
-                        connect(player, &QMediaPlayer::destroyed, this, [opener, stream]() { opener->close(stream); });
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-                    player->setMedia(url, stream);
-#else
-                    player->setSourceDevice(stream, url);
-#endif
-                    auto part = double(format.playPosition()) / double(scaleFillRect.width());
-
-                    if (player->duration() > 0) {
-                        player->setPosition(qint64(player->duration() * part));
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-                        player->setNotifyInterval(int(player->duration() / double(metaRect.width()) * 3.0)); // 3 px
-#endif
-                        connect(player, SIGNAL(positionChanged(qint64)), this, SLOT(playerPositionChanged(qint64)));
-                    } else {
-                        connect(player, &QMediaPlayer::durationChanged, [player, part, this](qint64 duration) {
-                            // the timer is a workaround for some Qt bug
-                            QTimer::singleShot(0, player, [this, player, part, duration]() {
-                                if (part > 0) { // don't jump back if event came quite late
-                                    player->setPosition(qint64(duration * part));
-                                }
-                                // qDebug() << int(duration / double(metaRect.width()));
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-                                player->setNotifyInterval(int(duration / 1000.0 / double(metaRect.width()) * 3.0));
-#endif
-                                connect(player, SIGNAL(positionChanged(qint64)), this,
-                                        SLOT(playerPositionChanged(qint64)));
-                            });
-                        });
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-                        player->setNotifyInterval(50); // while we don't know duration, lets use quite small value
-#endif
-                    }
-
-                    // check for title in metadata
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-                    connect(player, &QMediaPlayer::metaDataAvailableChanged, this, [this, player](bool available) {
-                        if (available) {
-                            auto title = player->metaData(QMediaMetaData::Title).toString();
-#else
-                    connect(player, &QMediaPlayer::metaDataChanged, this, [this, player]() {
-                        auto title = player->metaData().value(QMediaMetaData::Title).toString();
-#endif
-
-                            if (title.isEmpty()) {
-                                return;
-                            }
-                            quint32     playerId      = player->property("playerId").toUInt();
-                            int         textCursorPos = player->property("cursorPos").toInt();
-                            QTextCursor cursor        = itc->findElement(playerId, textCursorPos);
-                            if (cursor.isNull()) {
-                                return;
-                            }
-                            auto format = AudioMessageFormat::fromCharFormat(cursor.charFormat().toCharFormat());
-
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-                            if (format.metaData().type() == QVariant::List) {
-#else
-                        if (format.metaData().typeId() == QMetaType::QVariantList) {
-#endif
-                                return; // seems we have amplitudes already
-                            }
-                            format.setMetaData(title);
-                            cursor.setCharFormat(format);
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-                        }
-#endif
-                    });
-
-                    // try to extract from metadata and store amplitudes
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-                    connect(player,
-                            static_cast<void (QMediaPlayer::*)(const QString &, const QVariant &)>(
-                                &QMediaPlayer::metaDataChanged),
-                            [this, player](const QString &key, const QVariant &value) {
-                                if (key != QMediaMetaData::Comment) {
-                                    return;
-                                }
-                                auto comment = value.toString();
-#else
-                    connect(player, &QMediaPlayer::metaDataChanged, this, [this, player]() {
-                        auto comment = player->metaData().value(QMediaMetaData::Comment).toString();
-#endif
-                                int index = 0;
-                                if (comment.isEmpty() || !comment.startsWith(QLatin1String("AMPLDIAGSTART"))
-                                    || (index = comment.indexOf("AMPLDIAGEND")) == -1) {
-                                    return; // In comment we keep amplitudes. We don't expect anything else
-                                }
-                                auto sl
-                                    = comment
-                                          .mid(int(sizeof("AMPLDIAGSTART")), index - int(sizeof("AMPLDIAGSTART")) - 1)
-                                          .split(",");
-                                QList<float> amplitudes;
-                                amplitudes.reserve(sl.size());
-                                std::transform(sl.constBegin(), sl.constEnd(), std::back_inserter(amplitudes),
-                                               [](const QString &v) {
-                                                   auto fv = v.toFloat() / float(255.0);
-                                                   if (fv > 1) {
-                                                       return 1.0f;
-                                                   }
-                                                   return fv;
-                                               });
-
-                                quint32     playerId      = player->property("playerId").toUInt();
-                                int         textCursorPos = player->property("cursorPos").toInt();
-                                QTextCursor cursor        = itc->findElement(playerId, textCursorPos);
-                                if (cursor.isNull()) {
-                                    return;
-                                }
-
-                                auto format = AudioMessageFormat::fromCharFormat(cursor.charFormat().toCharFormat());
-                                format.setMetaData(QVariant::fromValue<decltype(amplitudes)>(amplitudes));
-                                cursor.setCharFormat(format);
-                            });
-
-                    QObject::connect(player, &QMediaPlayer::mediaStatusChanged, [=]() {
-#ifdef QITE_DEBUG
-                        qDebug() << "Media status changed:" << player->mediaStatus();
-#endif
-                    });
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-                    connect(player, &QMediaPlayer::stateChanged, this, &ITEAudioController::playerStateChanged);
-                    QObject::connect(player,
-                                     static_cast<void (QMediaPlayer::*)(QMediaPlayer::Error)>(&QMediaPlayer::error),
-                                     [=](QMediaPlayer::Error error) { qDebug() << "Error occurred:" << error; });
-#else
-                    QObject::connect(player, &QMediaPlayer::playbackStateChanged, this,
-                                     &ITEAudioController::playerStateChanged);
-                    QObject::connect(player, &QMediaPlayer::errorOccurred, this,
-                                     [=](QMediaPlayer::Error error, const QString &errorString) {
-                                         Q_UNUSED(error);
-                                         qDebug() << "Error occurred:" << errorString;
-                                     });
-#endif
+                    player = openPlayer(format, selected.anchor());
+                }
+                preloadedPlayers.removeOne(playerId);
+                touchPlayer(playerId);
+                routeOutput(playerId);
+                if (player->property("openRequest").isValid()) {
+                    state |= AudioMessageFormat::Opening; // it will start playing once opened
+                } else {
+                    player->play();
+                }
+                if (autoAdvance) {
+                    queueNext(playerId, selected.anchor());
                 }
-                // player->setVolume(0);
-                player->play();
             } else {
+                latencyProbe.cancel(playerId);
+                state &= ~AudioMessageFormat::Opening;
                 if (player) {
                     player->pause();
-                    // player->disconnect(this);activePlayers.take(playerId)->deleteLater();
+                    touchPlayer(playerId);
                 }
             }
         } else if (onTrackbar) {
             // include outline to clickable area but compute only for inner part
             double part;
-            if (event.pos.x() < scaleFillRect.left()) {
+            if (event.pos.x() < geometry.scaleFillRect.left()) {
                 part = 0;
-            } else if (event.pos.x() >= scaleFillRect.right()) {
+            } else if (event.pos.x() >= geometry.scaleFillRect.right()) {
                 part = 1;
             } else {
-                part = double(event.pos.x() - scaleFillRect.left()) / double(scaleFillRect.width());
+                part = double(event.pos.x() - geometry.scaleFillRect.left()) / double(geometry.scaleFillRect.width());
             }
             auto player = activePlayers.value(playerId);
             if (player) {
                 qDebug("Set position to %d", int(part * 100));
                 player->setPosition(qint64(player->duration() * part));
-            } // else it's not playing likely
-            format.setPlayPosition(quint32(double(scaleFillRect.width()) * part));
+                touchPlayer(playerId);
+            } else { // it's not playing likely
+                evictedPositions.remove(playerId);
+            }
+            format.setPlayPosition(quint32(double(geometry.scaleFillRect.width()) * part));
             positionSet = true;
         }
     }
@@ -600,39 +649,616 @@ bool ITEAudioController::mouseEvent(const Event &event, const QRect &rect, QText
     return true;
 }
 
+ITEAudioPlayer *ITEAudioController::createPlayer()
+{
+    auto player = audioBackend()->createPlayer(this);
+    // players are reused for different elements. so all the handlers have to take element id from the player
+    connect(player, &ITEAudioPlayer::positionChanged, this, &ITEAudioController::playerPositionChanged);
+    connect(player, &ITEAudioPlayer::durationChanged, this, &ITEAudioController::playerDurationChanged);
+    connect(player, &ITEAudioPlayer::stateChanged, this, &ITEAudioController::playerStateChanged);
+    connect(player, &ITEAudioPlayer::mediaStatusChanged, this, &ITEAudioController::playerMediaStatusChanged);
+    connect(player, &ITEAudioPlayer::metaDataChanged, this, &ITEAudioController::playerMetaDataChanged);
+    connect(player, &ITEAudioPlayer::errorOccurred, this,
+            [](const QString &errorString) { qDebug() << "Error occurred:" << errorString; });
+    return player;
+}
+
+ITEAudioPlayer *ITEAudioController::openPlayer(const AudioMessageFormat &format, int cursorPos)
+{
+    auto playerId = format.id();
+    auto player   = acquirePlayer(playerId, cursorPos);
+    auto opener   = asyncOpener(format);
+    auto url      = format.url();
+    // evicted players remember exact position, otherwise restore it from the scale
+    player->setProperty("seekPosition", evictedPositions.take(playerId));
+    player->setProperty("seekPart", double(format.playPosition()) / double(geometry.scaleFillRect.width()));
+    player->setNotifyInterval(50); // while we don't know duration, lets use quite small value
+    if (!opener) {
+        setPlayerSource(player, url, nullptr, nullptr);
+        return player;
+    }
+
+    auto opened    = std::make_shared<bool>(false); // the callback can be called right away
+    auto onOpened  = [this, player, playerId, opener, opened](QIODevice *stream, const QUrl &openedUrl) {
+        *opened = true;
+        mediaOpened(player, playerId, opener, openedUrl, stream); // the opener may have redirected it
+    };
+    auto requestId = opener->openAsync(url, onOpened);
+    if (!*opened) {
+        player->setProperty("openRequest", requestId);
+        player->setProperty("requestOpener", QVariant::fromValue<void *>(opener));
+    }
+    return player;
+}
+
+void ITEAudioController::setPlayerSource(ITEAudioPlayer *player, const QUrl &url, ITEAsyncMediaOpener *opener,
+                                         QIODevice *stream)
+{
+    player->setProperty("mediaOpener", QVariant::fromValue<void *>(stream ? opener : nullptr));
+    player->setProperty("mediaStream", QVariant::fromValue<void *>(stream));
+    // sequential streams are usually fed by their thread's event loop, so they can't be read ahead in another thread.
+    // and there is nothing to read ahead for in-memory ones
+    QIODevice *device = stream;
+    if (stream && readAheadSize > 0 && !stream->isSequential() && !qobject_cast<QBuffer *>(stream)) {
+        auto readAhead = new ITEReadAheadDevice(stream, readAheadSize, player);
+        if (readAhead->open(QIODevice::ReadOnly)) {
+            device = readAhead;
+            player->setProperty("readAhead", QVariant::fromValue<void *>(readAhead));
+        } else {
+            delete readAhead;
+        }
+    }
+    player->setSource(url, device);
+    if (player->duration() > 0) {
+        seekPending(player);
+    } // else it will be done on durationChanged
+}
+
+void ITEAudioController::mediaOpened(ITEAudioPlayer *player, quint32 playerId, ITEAsyncMediaOpener *opener,
+                                     const QUrl &url, QIODevice *stream)
+{
+    player->setProperty("openRequest", QVariant());
+    player->setProperty("requestOpener", QVariant());
+    if (activePlayers.value(playerId) != player) {
+        // released in the meantime. the opener was supposed to forget the request but anyway
+        if (stream) {
+            opener->close(stream);
+        }
+        return;
+    }
+    latencyProbe.mark(playerId, MediaOpenedStage);
+    setPlayerSource(player, url, opener, stream);
+
+    QTextCursor cursor = findElement(playerId, player->property("cursorPos").toInt());
+    bool        play   = false;
+    if (!cursor.isNull()) {
+        auto afmt = AudioMessageFormat::fromCharFormat(cursor.charFormat());
+        play      = afmt.state() & AudioMessageFormat::Playing;
+        if (afmt.state() & AudioMessageFormat::Opening) {
+            afmt.setState(afmt.state() & ~AudioMessageFormat::Opening);
+            cursor.setCharFormat(afmt);
+        }
+    }
+    if (play) {
+        touchPlayer(playerId);
+        routeOutput(playerId);
+        player->play();
+    } else {
+        player->pause(); // pre-roll
+    }
+}
+
+ITEAudioPlayer *ITEAudioController::acquirePlayer(quint32 playerId, int cursorPos)
+{
+    if (activePlayers.size() >= maxPlayers) {
+        evictPlayer();
+    }
+
+    auto player = sparePlayers.isEmpty() ? createPlayer() : sparePlayers.takeLast();
+    player->setProperty("playerId", playerId);
+    player->setProperty("cursorPos", cursorPos);
+    activePlayers.insert(playerId, player);
+    if (!reapTimer->isActive()) {
+        reapTimer->start();
+    }
+    return player;
+}
+
+bool ITEAudioController::evictPlayer()
+{
+    // it will continue from the same place on next play
+    for (auto id : std::as_const(playersLru)) {
+        auto candidate = activePlayers.value(id);
+        if (candidate && candidate->state() != ITEAudioPlayer::PlayingState) {
+            auto position = candidate->position();
+            releasePlayer(id); // it's fine to modify the list since we return right after
+            if (position > 0) {
+                evictedPositions.insert(id, position);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void ITEAudioController::releasePlayer(quint32 playerId)
+{
+    auto player = activePlayers.take(playerId);
+    if (!player) {
+        return;
+    }
+    playersLru.removeOne(playerId);
+    preloadedPlayers.removeOne(playerId);
+    latencyProbe.cancel(playerId);
+    if (progress.remove(playerId)) {
+        stopAnimation(playerId);
+    }
+    auto requestOpener = static_cast<ITEAsyncMediaOpener *>(player->property("requestOpener").value<void *>());
+    if (requestOpener) {
+        requestOpener->cancel(player->property("openRequest").toUInt());
+        player->setProperty("openRequest", QVariant());
+        player->setProperty("requestOpener", QVariant());
+    }
+    {
+        QSignalBlocker blocker(player); // reset of the player is not a state change of the element
+        player->stop();
+        player->setSource(QUrl());
+    }
+    delete static_cast<ITEReadAheadDevice *>(player->property("readAhead").value<void *>()); // stops reading the stream
+    auto opener = static_cast<ITEAsyncMediaOpener *>(player->property("mediaOpener").value<void *>());
+    auto stream = static_cast<QIODevice *>(player->property("mediaStream").value<void *>());
+    if (opener) {
+        opener->close(stream);
+    }
+    player->setProperty("mediaOpener", QVariant());
+    player->setProperty("mediaStream", QVariant());
+    player->setProperty("readAhead", QVariant());
+    player->setProperty("nextPlayerId", QVariant());
+    player->setProperty("lastActive", playerClock.elapsed());
+
+    if (sparePlayers.size() < maxPlayers) {
+        sparePlayers.append(player);
+    } else {
+        player->deleteLater();
+    }
+}
+
+void ITEAudioController::routeOutput(quint32 playerId)
+{
+    // the output is shared, so only one element plays at a time
+    for (auto it = activePlayers.cbegin(); it != activePlayers.cend(); ++it) {
+        if (it.key() == playerId || it.value()->state() != ITEAudioPlayer::PlayingState) {
+            continue;
+        }
+        it.value()->pause();
+        QTextCursor cursor = findElement(it.key(), it.value()->property("cursorPos").toInt());
+        if (!cursor.isNull()) {
+            auto afmt = AudioMessageFormat::fromCharFormat(cursor.charFormat());
+            afmt.setState(afmt.state() & ~AudioMessageFormat::Playing);
+            cursor.setCharFormat(afmt);
+        }
+    }
+    auto player = activePlayers.value(playerId);
+    if (player) {
+        audioBackend()->routeOutput(player);
+    }
+}
+
+void ITEAudioController::setVolume(float volume)
+{
+    outputVolume = qBound(0.0f, volume, 1.0f);
+    if (backend) {
+        backend->setVolume(outputVolume);
+    }
+}
+
+void ITEAudioController::setMuted(bool muted)
+{
+    outputMuted = muted;
+    if (backend) {
+        backend->setMuted(muted);
+    }
+}
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+void ITEAudioController::setAudioDevice(const QAudioDevice &device)
+{
+    auto mpBackend = qobject_cast<ITEMediaPlayerBackend *>(audioBackend());
+    if (mpBackend) {
+        mpBackend->setAudioDevice(device);
+    }
+}
+#endif
+
+void ITEAudioController::setBackend(ITEAudioBackend *newBackend)
+{
+    // players of the old backend can't be used anymore
+    for (auto id : activePlayers.keys()) {
+        auto player   = activePlayers.value(id);
+        auto position = player->position();
+        // the release is silent, so the element has to stop showing it plays
+        QTextCursor cursor = findElement(id, player->property("cursorPos").toInt());
+        if (!cursor.isNull()) {
+            auto fmt = AudioMessageFormat::fromCharFormat(cursor.charFormat());
+            if (fmt.state() & (AudioMessageFormat::Playing | AudioMessageFormat::Opening)) {
+                fmt.setState(fmt.state() & ~(AudioMessageFormat::Playing | AudioMessageFormat::Opening));
+                cursor.setCharFormat(fmt);
+            }
+        }
+        releasePlayer(id);
+        if (position > 0) {
+            evictedPositions.insert(id, position);
+        }
+    }
+    qDeleteAll(sparePlayers);
+    sparePlayers.clear();
+    if (backend && backend->parent() == this) {
+        delete backend;
+    }
+    backend = newBackend; // the default one is created on demand
+    if (backend) {
+        if (!backend->parent()) {
+            backend->setParent(this);
+        }
+        backend->setVolume(outputVolume);
+        backend->setMuted(outputMuted);
+    }
+}
+
+ITEAudioBackend *ITEAudioController::audioBackend()
+{
+    if (!backend) {
+        backend = new ITEMediaPlayerBackend(this);
+        backend->setVolume(outputVolume);
+        backend->setMuted(outputMuted);
+    }
+    return backend;
+}
+
+void ITEAudioController::touchPlayer(quint32 playerId)
+{
+    playersLru.removeOne(playerId);
+    playersLru.append(playerId);
+    auto player = activePlayers.value(playerId);
+    if (player) {
+        player->setProperty("lastActive", playerClock.elapsed());
+    }
+}
+
+void ITEAudioController::seekPending(ITEAudioPlayer *player)
+{
+    auto duration = player->duration();
+    auto position = player->property("seekPosition").toLongLong();
+    auto part     = player->property("seekPart").toDouble();
+    player->setProperty("seekPosition", QVariant());
+    player->setProperty("seekPart", QVariant());
+    if (position > 0) {
+        player->setPosition(position);
+    } else if (part > 0) { // don't jump back if event came quite late
+        player->setPosition(qint64(duration * part));
+    }
+}
+
+void ITEAudioController::queueNext(quint32 playerId, int cursorPos)
+{
+    auto player = activePlayers.value(playerId);
+    if (!player) {
+        return;
+    }
+    player->setProperty("nextPlayerId", QVariant());
+    QTextCursor cursor = findElement(playerId, cursorPos);
+    if (cursor.isNull()) {
+        return;
+    }
+    cursor = findNextElement(cursor);
+    if (cursor.isNull()) {
+        return;
+    }
+
+    auto format = AudioMessageFormat::fromCharFormat(cursor.charFormat());
+    auto nextId = format.id();
+    preloadedPlayers.removeOne(nextId); // it's queued now. the preload budget shouldn't evict it
+    if (!activePlayers.contains(nextId)) {
+        auto next = openPlayer(format, cursor.anchor());
+        if (!next->property("openRequest").isValid()) {
+            next->pause(); // pre-roll while the current one plays
+        }
+    }
+    touchPlayer(nextId);
+    player->setProperty("nextPlayerId", nextId);
+}
+
+void ITEAudioController::setAutoAdvance(bool advance)
+{
+    autoAdvance = advance;
+    if (!advance) {
+        return;
+    }
+    for (auto it = activePlayers.cbegin(); it != activePlayers.cend(); ++it) {
+        if (it.value()->state() == ITEAudioPlayer::PlayingState) {
+            queueNext(it.key(), it.value()->property("cursorPos").toInt());
+            break;
+        }
+    }
+}
+
+bool ITEAudioController::loadHistogramStore(const QString &fileName, const QString &rootPath)
+{
+    histogramStore.setRootPath(rootPath);
+    if (!histogramStore.load(fileName)) {
+        qWarning("Failed to load histogram store %s", qPrintable(fileName));
+        return false;
+    }
+    return true;
+}
+
+void ITEAudioController::reapIdlePlayers()
+{
+    auto now = playerClock.elapsed();
+    const auto lru = playersLru; // release modifies the list
+    for (auto id : lru) {
+        auto player = activePlayers.value(id);
+        if (player && player->state() != ITEAudioPlayer::PlayingState
+            && now - player->property("lastActive").toLongLong() >= playerIdleTimeout) {
+            auto position = player->position();
+            releasePlayer(id);
+            if (position > 0) {
+                evictedPositions.insert(id, position);
+            }
+        }
+    }
+    for (int i = sparePlayers.size() - 1; i >= 0; i--) {
+        if (now - sparePlayers[i]->property("lastActive").toLongLong() >= playerIdleTimeout) {
+            sparePlayers.takeAt(i)->deleteLater();
+        }
+    }
+    if (activePlayers.isEmpty() && sparePlayers.isEmpty()) {
+        reapTimer->stop();
+    }
+}
+
+void ITEAudioController::setMaxPlayers(int count)
+{
+    maxPlayers = qMax(1, count);
+    while (activePlayers.size() > maxPlayers && evictPlayer()) { }
+    while (sparePlayers.size() > maxPlayers) {
+        sparePlayers.takeLast()->deleteLater();
+    }
+}
+
+void ITEAudioController::setPlayerIdleTimeout(int ms)
+{
+    playerIdleTimeout = ms;
+    reapTimer->setInterval(qMax(1000, ms / 2));
+}
+
 void ITEAudioController::hideEvent(QTextCursor &selected)
 {
     auto fmt    = AudioMessageFormat::fromCharFormat(selected.charFormat());
     auto player = activePlayers.value(fmt.id());
     // qDebug() << "hiding player" << fmt.id();
-    if (player) {
+    bool queued = false;
+    if (player && autoAdvance && player->state() != ITEAudioPlayer::PlayingState) {
+        for (auto p : std::as_const(activePlayers)) {
+            if (p->property("nextPlayerId").toUInt() == fmt.id() && p->property("nextPlayerId").isValid()) {
+                queued = true; // keep it buffered, it's going to play soon
+                break;
+            }
+        }
+    }
+    if (queued) {
+        preloadedPlayers.removeOne(fmt.id());
+    } else if (player && player->property("openRequest").isValid()) {
+        releasePlayer(fmt.id()); // there is nothing to stop yet
+        if (fmt.state() & (AudioMessageFormat::Playing | AudioMessageFormat::Opening)) {
+            fmt.setState(fmt.state() & ~(AudioMessageFormat::Playing | AudioMessageFormat::Opening));
+            selected.setCharFormat(fmt);
+        }
+    } else if (player) {
         player->stop();
+    } else if (evictedPositions.remove(fmt.id())) { // behave like it was stopped
+        fmt.setPlayPosition(0);
+        selected.setCharFormat(fmt);
+    }
+
+    auto url = fmt.url();
+    if (fmt.metaDataState() == AudioMessageFormat::RequestInProgress && metadataRequests.contains(url)) {
+        for (auto it = metadataWaiters.find(url); it != metadataWaiters.end() && it.key() == url;) {
+            if (it.value().first == fmt.id()) {
+                it = metadataWaiters.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (!metadataWaiters.contains(url)) {
+            auto request = metadataRequests.take(url);
+            request.first->cancel(request.second);
+            QITE_STATS_ADD(MetadataRequestsInFlight, -1);
+        }
+        fmt.setMetaDataState(AudioMessageFormat::NotRequested);
+        selected.setCharFormat(fmt);
+    }
+
+    // don't waste time on decoding of what is not visible anymore
+    if (histogramGenerator && fmt.metaDataState() == AudioMessageFormat::RequestInProgress) {
+        bool lastWaiter = true;
+        for (auto it = histogramWaiters.constFind(url); it != histogramWaiters.constEnd() && it.key() == url; ++it) {
+            if (it.value().first != fmt.id()) {
+                lastWaiter = false;
+                break;
+            }
+        }
+        if (lastWaiter && histogramGenerator->cancel(url)) {
+            histogramWaiters.remove(url);
+            fmt.setMetaDataState(AudioMessageFormat::NotRequested);
+            selected.setCharFormat(fmt);
+        }
+    }
+}
+
+void ITEAudioController::preloadEvent(QTextCursor &selected)
+{
+    auto format   = AudioMessageFormat::fromCharFormat(selected.charFormat());
+    auto playerId = format.id();
+    if (preloadBudget <= 0 || activePlayers.contains(playerId)) {
+        return;
+    }
+    if (preloadedPlayers.size() >= preloadBudget) {
+        // the oldest one is likely the one we are scrolling away from
+        releasePlayer(preloadedPlayers.first());
+    }
+
+    auto player = openPlayer(format, selected.anchor());
+    preloadedPlayers.append(playerId);
+    touchPlayer(playerId);
+    if (!player->property("openRequest").isValid()) {
+        player->pause(); // pre-roll. hideEvent will stop and release it
+    } // else it's paused once opened
+}
+
+void ITEAudioController::pageOutEvent(QTextCursor &selected)
+{
+    auto fmt    = AudioMessageFormat::fromCharFormat(selected.charFormat());
+    auto player = activePlayers.value(fmt.id());
+    if (player) {
+        // even a playing one is stopped. the element can't be found anymore, so neither its progress could be
+        // drawn nor auto advance could continue from it
+        auto position = player->position();
+        releasePlayer(fmt.id());
+        if (position > 0) {
+            evictedPositions.insert(fmt.id(), position); // continues from here once paged in
+        }
+        fmt.setState(fmt.state() & ~(AudioMessageFormat::Playing | AudioMessageFormat::Opening));
+    }
+    for (auto p : std::as_const(activePlayers)) {
+        if (p->property("nextPlayerId").isValid() && p->property("nextPlayerId").toUInt() == fmt.id()) {
+            p->setProperty("nextPlayerId", QVariant()); // don't advance to a paged out element
+        }
+    }
+
+    // waiters of a paged out element are skipped. the results are cached, so it asks again once paged in
+    if (fmt.metaDataState() == AudioMessageFormat::RequestInProgress) {
+        fmt.setMetaDataState(AudioMessageFormat::NotRequested);
+    }
+    selected.setCharFormat(fmt);
+}
+
+QTextCharFormat ITEAudioController::snapshotFormat(const QTextCharFormat &format) const
+{
+    auto fmt = AudioMessageFormat::fromCharFormat(format);
+    fmt.clearProperty(AudioMessageFormat::MediaOpener);
+    fmt.clearProperty(AudioMessageFormat::AsyncMediaOpener);
+    fmt.setState(AudioMessageFormat::Flags()); // nothing plays or is hovered after restore
+    if (fmt.metaDataState() == AudioMessageFormat::RequestInProgress) {
+        fmt.setMetaDataState(AudioMessageFormat::NotRequested);
+    }
+    auto metadata = fmt.metaData();
+    if (metadata.userType() == qMetaTypeId<Histogram>()) {
+        // there are no stream operators for it. back to the compressed form
+        const auto histogram = metadata.value<Histogram>();
+        QByteArray compressed;
+        compressed.reserve(histogram.size());
+        for (auto v : histogram) {
+            compressed.append(char(qBound(0, int(v * 256.0f), 255)));
+        }
+        fmt.setMetaData(compressed);
+    }
+    return fmt;
+}
+
+void ITEAudioController::restoreFormat(QTextCharFormat &format)
+{
+    auto fmt      = AudioMessageFormat::fromCharFormat(format);
+    auto metadata = fmt.metaData();
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    if (metadata.type() == QVariant::ByteArray) {
+#else
+    if (metadata.typeId() == QMetaType::QByteArray) {
+#endif
+        fmt.setMetaData(QVariant::fromValue<Histogram>(histogramFromBytes(metadata.toByteArray())));
+    }
+    if (openerResolver) {
+        fmt.setAsyncMediaOpener(openerResolver(fmt.url()));
+    }
+    format = fmt;
+}
+
+void ITEAudioController::saveState(QDataStream &stream) const
+{
+    auto positions = evictedPositions;
+    for (auto it = activePlayers.constBegin(); it != activePlayers.constEnd(); ++it) {
+        auto position = it.value()->position();
+        if (it.value()->state() != ITEAudioPlayer::StoppedState && position > 0) {
+            positions.insert(it.key(), position);
+        }
+    }
+    stream << positions;
+}
+
+void ITEAudioController::restoreState(QDataStream &stream, const QHash<quint32, quint32> &ids)
+{
+    QHash<quint32, qint64> positions;
+    stream >> positions;
+    for (auto it = positions.constBegin(); it != positions.constEnd(); ++it) {
+        auto id = ids.value(it.key());
+        if (id) {
+            evictedPositions.insert(id, it.value()); // openPlayer seeks there
+        }
     }
 }
 
 bool ITEAudioController::isOnButton(const QPoint &pos, const QRect &rect)
 {
     QPoint rel = pos - rect.topLeft();
-    return QVector2D(btnCenter).distanceToPoint(QVector2D(rel)) <= btnRadius;
+    return QVector2D(geometry.btnCenter).distanceToPoint(QVector2D(rel)) <= geometry.btnRadius;
+}
+
+quint32 ITEAudioController::pixelPosition(qint64 position, qint64 duration) const
+{
+    double part = 0.0;
+    if (position > duration) { // workarund for https://bugreports.qt.io/browse/QTBUG-79282
+        part = position ? 1.0 : 0.0;
+    } else if (duration > 0) {
+        part = double(position) / double(duration);
+    }
+    return quint32(geometry.scaleFillRect.width() * part);
+}
+
+bool ITEAudioController::animationFrame(quint32 elementId, qint64 frameTime)
+{
+    auto it = progress.constFind(elementId);
+    if (it == progress.constEnd() || !it->duration) {
+        return false;
+    }
+    auto elapsed = qBound(qint64(0), frameTime - it->time, MaxProgressExtrapolation);
+    return pixelPosition(qMin(it->position + elapsed, it->duration), it->duration) != it->drawnPixel;
 }
 
 void ITEAudioController::playerPositionChanged(qint64 newPos)
 {
-    auto        player        = static_cast<QMediaPlayer *>(sender());
-    quint32     playerId      = player->property("playerId").toUInt();
+    auto    player   = static_cast<ITEAudioPlayer *>(sender());
+    quint32 playerId = player->property("playerId").toUInt();
+    auto    pit      = progress.find(playerId);
+    if (latencyProbe.isMarked(playerId, PlayingStage)) {
+        latencyProbe.mark(playerId, FirstPositionStage); // otherwise it's likely a seek to the restored position
+    }
+    if (pit != progress.end()) {
+        // playing. frames interpolate from here, so the document isn't touched on every notification
+        pit->position = newPos;
+        pit->duration = player->duration();
+        pit->time     = itc->frameTime();
+        return;
+    }
     int         textCursorPos = player->property("cursorPos").toInt();
-    QTextCursor cursor        = itc->findElement(playerId, textCursorPos);
+    QTextCursor cursor        = findElement(playerId, textCursorPos);
     if (!cursor.isNull()) {
-        auto   audioFormat  = AudioMessageFormat::fromCharFormat(cursor.charFormat());
-        auto   lastPixelPos = audioFormat.playPosition();
-        auto   duration     = player->duration();
-        double part         = 0.0;
-        if (!duration || newPos > duration) { // workarund for https://bugreports.qt.io/browse/QTBUG-79282
-            part = newPos ? 1.0 : 0.0;
-        } else {
-            part = double(newPos) / double(duration);
+        auto duration = player->duration();
+        if (!duration) {
+            return; // nothing to show yet. the position will be restored when duration is known
         }
-        auto newPixelPos = decltype(lastPixelPos)(scaleFillRect.width() * part);
+        auto audioFormat  = AudioMessageFormat::fromCharFormat(cursor.charFormat());
+        auto lastPixelPos = audioFormat.playPosition();
+        auto newPixelPos  = pixelPosition(newPos, duration);
         if (newPixelPos != lastPixelPos) {
             // qDebug("pos %lld of %lld", newPos, duration);
             audioFormat.setPlayPosition(newPixelPos);
@@ -643,25 +1269,377 @@ void ITEAudioController::playerPositionChanged(qint64 newPos)
 
 void ITEAudioController::playerStateChanged(PlaybackState state)
 {
-    if (state == QMediaPlayer::StoppedState) {
-        auto        player        = static_cast<QMediaPlayer *>(sender());
-        quint32     playerId      = player->property("playerId").toUInt();
+    auto    player   = static_cast<ITEAudioPlayer *>(sender());
+    quint32 playerId = player->property("playerId").toUInt();
+    if (state == ITEAudioPlayer::PlayingState) {
+        latencyProbe.mark(playerId, PlayingStage);
+        auto &p    = progress[playerId];
+        p.position = player->position();
+        p.duration = player->duration();
+        p.time     = itc->frameTime();
+        startAnimation(playerId);
+        return;
+    }
+    if (progress.remove(playerId)) {
+        stopAnimation(playerId);
+    }
+    latencyProbe.cancel(playerId); // if it didn't reach the sound
+    if (state == ITEAudioPlayer::PausedState) {
+        // store where the animation stopped
         int         textCursorPos = player->property("cursorPos").toInt();
-        QTextCursor cursor        = itc->findElement(playerId, textCursorPos);
+        QTextCursor cursor        = findElement(playerId, textCursorPos);
+        if (!cursor.isNull() && player->duration()) {
+            auto audioFormat = AudioMessageFormat::fromCharFormat(cursor.charFormat());
+            auto pixelPos    = pixelPosition(player->position(), player->duration());
+            if (pixelPos != audioFormat.playPosition()) {
+                audioFormat.setPlayPosition(pixelPos);
+                cursor.setCharFormat(audioFormat);
+            }
+        }
+    } else if (state == ITEAudioPlayer::StoppedState) {
+        int         textCursorPos = player->property("cursorPos").toInt();
+        QTextCursor cursor        = findElement(playerId, textCursorPos);
         if (!cursor.isNull()) {
             auto audioFormat = AudioMessageFormat::fromCharFormat(cursor.charFormat());
             audioFormat.setState(audioFormat.state() & ~AudioMessageFormat::Playing);
             audioFormat.setPlayPosition(0);
             cursor.setCharFormat(audioFormat);
         }
-        qDebug("deleting player");
-        activePlayers.take(playerId)->deleteLater();
+        evictedPositions.remove(playerId);
+        // it's not a good idea to reset the player from its own signal
+        QTimer::singleShot(0, this, [this, player, playerId]() {
+            if (activePlayers.value(playerId) == player && player->state() == ITEAudioPlayer::StoppedState) {
+                releasePlayer(playerId);
+            }
+        });
+    }
+}
+
+void ITEAudioController::playerDurationChanged(qint64 duration)
+{
+    if (duration <= 0) {
+        return;
+    }
+    auto player = static_cast<ITEAudioPlayer *>(sender());
+    // the timer is a workaround for some Qt bug
+    QTimer::singleShot(0, player, [this, player]() {
+        seekPending(player);
+        // playing elements are animated by the frame clock. the notifications just correct the drift
+        player->setNotifyInterval(ProgressNotifyInterval);
+    });
+}
+
+void ITEAudioController::playerMetaDataChanged()
+{
+    auto        player        = static_cast<ITEAudioPlayer *>(sender());
+    quint32     playerId      = player->property("playerId").toUInt();
+    int         textCursorPos = player->property("cursorPos").toInt();
+    QTextCursor cursor        = findElement(playerId, textCursorPos);
+    if (cursor.isNull()) {
+        return;
+    }
+    auto format = AudioMessageFormat::fromCharFormat(cursor.charFormat());
+
+    // try to extract from metadata and store amplitudes
+    auto comment = player->metaData(ITEAudioPlayer::Comment).toString();
+    int  index   = 0;
+    if (!comment.isEmpty() && comment.startsWith(QLatin1String("AMPLDIAGSTART"))
+        && (index = comment.indexOf("AMPLDIAGEND")) != -1) { // In comment we keep amplitudes. Nothing else expected
+        auto sl = comment.mid(int(sizeof("AMPLDIAGSTART")), index - int(sizeof("AMPLDIAGSTART")) - 1).split(",");
+        QList<float> amplitudes;
+        amplitudes.reserve(sl.size());
+        std::transform(sl.constBegin(), sl.constEnd(), std::back_inserter(amplitudes), [](const QString &v) {
+            auto fv = v.toFloat() / float(255.0);
+            if (fv > 1) {
+                return 1.0f;
+            }
+            return fv;
+        });
+        format.setMetaData(QVariant::fromValue<decltype(amplitudes)>(amplitudes));
+        cursor.setCharFormat(format);
+        return;
+    }
+
+    // check for title in metadata
+    auto title = player->metaData(ITEAudioPlayer::Title).toString();
+    if (title.isEmpty()) {
+        return;
+    }
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    if (format.metaData().type() == QVariant::List) {
+#else
+    if (format.metaData().typeId() == QMetaType::QVariantList) {
+#endif
+        return; // seems we have amplitudes already
+    }
+    format.setMetaData(title);
+    cursor.setCharFormat(format);
+}
+
+void ITEAudioController::playerMediaStatusChanged(ITEAudioPlayer::MediaStatus status)
+{
+    auto player = static_cast<ITEAudioPlayer *>(sender());
+#ifdef QITE_DEBUG
+    qDebug() << "Media status changed:" << status;
+#endif
+    if (status != ITEAudioPlayer::EndOfMedia || !autoAdvance) {
+        return;
+    }
+    auto nextId = player->property("nextPlayerId");
+    player->setProperty("nextPlayerId", QVariant());
+    auto next = nextId.isValid() ? activePlayers.value(nextId.toUInt()) : nullptr;
+    if (!next) {
+        return;
+    }
+
+    // the next one is already buffered, so start it right away and only then update the elements
+    auto playerId = nextId.toUInt();
+    bool opening  = next->property("openRequest").isValid();
+    touchPlayer(playerId);
+    routeOutput(playerId);
+    if (!opening) {
+        next->play();
+    } // else it plays once opened since the element is marked as playing
+
+    int         cursorPos = next->property("cursorPos").toInt();
+    QTextCursor cursor    = findElement(playerId, cursorPos);
+    if (!cursor.isNull()) {
+        auto afmt = AudioMessageFormat::fromCharFormat(cursor.charFormat());
+        afmt.setState(afmt.state() | AudioMessageFormat::Playing
+                      | (opening ? AudioMessageFormat::Opening : AudioMessageFormat::Flags()));
+        cursor.setCharFormat(afmt);
+        cursorPos = cursor.anchor();
+    }
+    queueNext(playerId, cursorPos);
+}
+
+void ITEAudioController::queryMetadata(QTextCursor &cursor, AudioMessageFormat &format)
+{
+    auto opener = asyncOpener(format);
+    if (!opener) {
+        fetchMetadata(cursor, format);
+        return;
+    }
+
+    auto url    = format.url();
+    auto cached = metadataCache.constFind(url);
+    if (cached != metadataCache.constEnd()) {
+        if (cached->metadata.isValid()) {
+            format.setMetaData(cached->metadata.toMap().value(QLatin1String("amplitudes")));
+            cursor.setCharFormat(format);
+            return;
+        }
+        if (playerClock.elapsed() < cached->expires) {
+            fetchMetadata(cursor, format); // the opener didn't know it recently
+            return;
+        }
+        metadataCache.erase(cached);
+    }
+
+    metadataWaiters.insert(url, qMakePair(format.id(), cursor.anchor()));
+    format.setMetaDataState(AudioMessageFormat::RequestInProgress);
+    cursor.setCharFormat(format);
+    if (metadataRequests.contains(url)) {
+        return; // another element with the same media asked already
+    }
+    auto done      = std::make_shared<bool>(false); // the callback can be called right away
+    auto requestId = opener->metadataAsync(url, [this, url, done](const QVariant &metadata) {
+        *done = true;
+        if (metadataRequests.remove(url)) {
+            QITE_STATS_ADD(MetadataRequestsInFlight, -1);
+        }
+        metadataReady(url, metadata);
+    });
+    if (!*done) {
+        metadataRequests.insert(url, qMakePair(opener, requestId));
+        QITE_STATS_ADD(MetadataRequestsInFlight, 1);
+    }
+}
+
+void ITEAudioController::metadataReady(const QUrl &url, const QVariant &metadata)
+{
+    MetadataCacheEntry entry;
+    entry.metadata = metadata;
+    entry.expires  = metadata.isValid() ? 0 : playerClock.elapsed() + metadataNegativeTtl;
+    metadataCache.insert(url, entry);
+
+    const auto waiters = metadataWaiters.values(url);
+    metadataWaiters.remove(url);
+    for (auto const &waiter : waiters) {
+        QTextCursor cursor = findElement(waiter.first, waiter.second);
+        if (cursor.isNull()) {
+            continue;
+        }
+        auto afmt = AudioMessageFormat::fromCharFormat(cursor.charFormat());
+        if (metadata.isValid()) {
+            afmt.setMetaData(metadata.toMap().value(QLatin1String("amplitudes")));
+            cursor.setCharFormat(afmt);
+        } else {
+            fetchMetadata(cursor, afmt); // the opener knows nothing. try to find it ourselves
+        }
+    }
+}
+
+void ITEAudioController::fetchMetadata(QTextCursor &cursor, AudioMessageFormat &format)
+{
+    auto       url = format.url();
+    QByteArray stored;
+    if (url.isLocalFile() && !histogramStore.isEmpty() && histogramStore.find(url.toLocalFile(), &stored)) {
+        format.setMetaData(QVariant::fromValue<Histogram>(histogramFromBytes(stored)));
+        cursor.setCharFormat(format);
+        return;
+    }
+    if (!(autoFetchMetadata && url.path().endsWith(".mp4")) && !(autoGenerateHistogram && url.isLocalFile())) {
+        format.setMetaData(QVariant()); // nothing else we can do
+        cursor.setCharFormat(format);
+        return;
+    }
+
+    // time to query amplitudes file
+    QUrl metaUrl(url);
+    metaUrl.setPath(metaUrl.path() + ".amplitudes");
+    if (metaUrl.isLocalFile()) {
+        QFile file(metaUrl.toLocalFile());
+        if (file.open(QIODevice::ReadOnly)) {
+            format.setMetaData(QVariant::fromValue<Histogram>(histogramFromDevice(&file)));
+            cursor.setCharFormat(format);
+        } else if (autoGenerateHistogram) {
+            generateHistogram(cursor, format);
+        } else {
+            format.setMetaData(QVariant());
+            cursor.setCharFormat(format);
+        }
+        return;
+    }
+    if (metaUrl.scheme() != QLatin1String("http") && metaUrl.scheme() != QLatin1String("https")) {
+        format.setMetaData(QVariant()); // qitebuffer: and alike are known only to their openers
+        cursor.setCharFormat(format);
+        return;
+    }
+    if (!nam) {
+        nam = new QNetworkAccessManager(this);
+    }
+    auto reply = nam->get(QNetworkRequest(metaUrl));
+    QITE_STATS_ADD(MetadataRequestsInFlight, 1);
+    format.setMetaDataState(AudioMessageFormat::RequestInProgress);
+    cursor.setCharFormat(format);
+    auto id  = format.id();
+    auto pos = cursor.anchor();
+    connect(reply, &QNetworkReply::finished, this, [this, id, pos, reply]() {
+        QITE_STATS_ADD(MetadataRequestsInFlight, -1);
+        QTextCursor cursor = findElement(id, pos);
+        if (!cursor.isNull()) {
+            auto afmt = AudioMessageFormat::fromCharFormat(cursor.charFormat());
+            afmt.setMetaData(QVariant::fromValue<Histogram>(histogramFromDevice(reply)));
+            cursor.setCharFormat(afmt);
+        }
+        reply->close();
+        reply->deleteLater();
+    });
+}
+
+void ITEAudioController::generateHistogram(QTextCursor &cursor, AudioMessageFormat &format)
+{
+    auto       url = format.url();
+    QByteArray histogram;
+    if (histogramGenerator && histogramGenerator->cached(url, &histogram)) {
+        format.setMetaData(histogram.isEmpty() ? QVariant()
+                                               : QVariant::fromValue<Histogram>(histogramFromBytes(histogram)));
+        cursor.setCharFormat(format);
+        return;
+    }
+
+    if (!histogramGenerator) {
+        histogramGenerator = new HistogramGenerator(this);
+        connect(histogramGenerator, &HistogramGenerator::finished, this, &ITEAudioController::histogramGenerated);
+    }
+    histogramWaiters.insert(url, qMakePair(format.id(), cursor.anchor()));
+    format.setMetaDataState(AudioMessageFormat::RequestInProgress);
+    cursor.setCharFormat(format);
+    histogramGenerator->request(url);
+}
+
+void ITEAudioController::histogramGenerated(const QUrl &url, const QByteArray &histogram)
+{
+    const auto waiters = histogramWaiters.values(url);
+    histogramWaiters.remove(url);
+
+    // even failure is a final state. we don't want to decode the file again on each paint
+    QVariant metaData;
+    if (!histogram.isEmpty()) {
+        metaData = QVariant::fromValue<Histogram>(histogramFromBytes(histogram));
+    }
+    for (auto const &waiter : waiters) {
+        QTextCursor cursor = findElement(waiter.first, waiter.second);
+        if (cursor.isNull()) {
+            continue;
+        }
+        auto afmt = AudioMessageFormat::fromCharFormat(cursor.charFormat());
+        afmt.setMetaData(metaData);
+        cursor.setCharFormat(afmt);
     }
 }
 
 ITEAudioController::ITEAudioController(InteractiveText *itc, QObject *parent) :
-    InteractiveTextElementController(itc, parent)
+    InteractiveTextElementController(itc, parent),
+    latencyProbe({ QLatin1String("click"), QLatin1String("media opened"), QLatin1String("playing"),
+                   QLatin1String("first position") })
+{
+    playerClock.start();
+    reapTimer = new QTimer(this);
+    reapTimer->setInterval(playerIdleTimeout / 2);
+    connect(reapTimer, &QTimer::timeout, this, &ITEAudioController::reapIdlePlayers);
+}
+
+ITEAudioController::~ITEAudioController()
 {
+    // close opened streams
+    for (auto id : activePlayers.keys()) {
+        releasePlayer(id);
+    }
+    for (auto const &request : std::as_const(metadataRequests)) {
+        request.first->cancel(request.second);
+        QITE_STATS_ADD(MetadataRequestsInFlight, -1);
+    }
 }
 
 QCursor ITEAudioController::cursor() { return _cursor; }
+
+//----------------------------------------------------------------------------
+// ITEBufferMediaOpener
+//----------------------------------------------------------------------------
+QUrl ITEBufferMediaOpener::add(const QByteArray &data, const QByteArray &amplitudes, const QString &suffix)
+{
+    QUrl url;
+    url.setScheme(QLatin1String("qitebuffer"));
+    url.setPath(QString::number(++_lastId) + QLatin1Char('.') + suffix);
+
+    Entry entry;
+    entry.data = data;
+    if (!amplitudes.isEmpty()) {
+        QVariantMap md;
+        md.insert(QLatin1String("amplitudes"),
+                  QVariant::fromValue<ITEAudioController::Histogram>(histogramFromBytes(amplitudes)));
+        entry.metadata = md;
+    }
+    _entries.insert(url, entry);
+    return url;
+}
+
+void ITEBufferMediaOpener::remove(const QUrl &url) { _entries.remove(url); }
+
+QIODevice *ITEBufferMediaOpener::open(QUrl &url)
+{
+    auto it = _entries.constFind(url);
+    if (it == _entries.constEnd()) {
+        return nullptr;
+    }
+    auto buffer = new QBuffer;
+    buffer->setData(it->data); // implicitly shared. QBuffer doesn't detach it while reading
+    buffer->open(QIODevice::ReadOnly);
+    return buffer;
+}
+
+void ITEBufferMediaOpener::close(QIODevice *dev) { delete dev; }
+
+QVariant ITEBufferMediaOpener::metadata(const QUrl &url) { return _entries.value(url).metadata; }
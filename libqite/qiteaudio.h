@@ -20,69 +20,244 @@ under the License.
 #ifndef QITEAUDIO_H
 #define QITEAUDIO_H
 
+#include <QBrush>
 #include <QCursor>
-#include <QMediaPlayer>
+#include <QFont>
+#include <QHash>
+#include <QElapsedTimer>
+#include <QMultiHash>
 #include <QObject>
+#include <QPen>
+#include <QUrl>
 
 #include "qite.h"
+#include "qiteaudiobackend.h"
+#include "qitehistogram.h"
+#include "qitestats.h"
 
-class QMediaPlayer;
+class QAudioDevice;
 class QNetworkAccessManager;
+class QTimer;
 class AudioMessageFormat;
 
 class ITEAudioController : public InteractiveTextElementController {
     Q_OBJECT
 
-    QCursor                       _cursor;
-    QMap<quint32, QMediaPlayer *> activePlayers;
-    QNetworkAccessManager        *nam = nullptr;
-
-    // geometry
-    QSize   elementSize;
-    QRect   bgRect;
-    QRect   metaRect;
-    int     bgOutlineWidth;
-    double  baseSize;
-    double  bgRectRadius;
-    QPointF btnCenter;
-    int     btnRadius;
-    int     signSize;
-    int     scaleOutlineWidth;
-    QRectF  scaleRect, scaleFillRect;
-    int     lastFontSize      = 0;
-    bool    autoFetchMetadata = false;
+    QCursor                               _cursor;
+    ITEAudioBackend                      *backend            = nullptr;
+    QMap<quint32, ITEAudioPlayer *>       activePlayers;
+    QList<ITEAudioPlayer *>               sparePlayers;     // released players ready for reuse
+    QList<quint32>                        playersLru;       // ids of active players. least recently used first
+    QList<quint32>                        preloadedPlayers; // ids of opened but never played players
+    QHash<quint32, qint64>                evictedPositions; // element id -> position of evicted paused player
+    QTimer                               *reapTimer          = nullptr;
+    QElapsedTimer                         playerClock;
+    int                                   maxPlayers         = 4;
+    int                                   preloadBudget      = 2;
+    int                                   playerIdleTimeout  = 60000;
+    qint64                                readAheadSize      = 1024 * 1024;
+    float                                 outputVolume       = 1.0f;
+    bool                                  outputMuted        = false;
+    QNetworkAccessManager                *nam                = nullptr;
+    HistogramGenerator                   *histogramGenerator = nullptr;
+    QMultiHash<QUrl, QPair<quint32, int>> histogramWaiters; // url -> (element id, cursor position hint)
+    HistogramStore                        histogramStore;   // pregenerated by qite-amplitudes --store
+
+    // async opening
+    struct MetadataCacheEntry {
+        QVariant metadata;
+        qint64   expires = 0; // playerClock time when an invalid result may be asked again
+    };
+    QHash<ITEMediaOpener *, ITESyncMediaOpenerAdapter *>                      syncOpeners;
+    QHash<QUrl, QPair<ITEAsyncMediaOpener *, ITEAsyncMediaOpener::RequestId>> metadataRequests;
+    QMultiHash<QUrl, QPair<quint32, int>>                                     metadataWaiters; // like histogramWaiters
+    QHash<QUrl, MetadataCacheEntry>                                           metadataCache;   // opener's metadata
+    int                                                                       metadataNegativeTtl = 60000;
+
+    // progress of playing elements is interpolated between rare position notifications on each frame
+    struct Progress {
+        qint64  position   = 0; // last reported by the player
+        qint64  duration   = 0;
+        qint64  time       = 0; // InteractiveText::frameTime() of the report
+        quint32 drawnPixel = 0;
+    };
+    QHash<quint32, Progress> progress; // element id -> progress
+    ITELatencyProbe          latencyProbe;
+
+    // geometry. painting with it doesn't touch the controller, so rasterizers paint with a copy on a worker thread
+    struct Geometry {
+        QSize   elementSize;
+        QRect   bgRect;
+        QRect   metaRect;
+        int     bgOutlineWidth;
+        double  baseSize;
+        double  bgRectRadius;
+        QPointF btnCenter;
+        int     btnRadius;
+        int     signSize;
+        int     scaleOutlineWidth;
+        QRectF  scaleRect, scaleFillRect;
+        QPen    bgPen, signPen, scalePen, metadataPen;
+        QBrush  bgBrush, buttonBrush, buttonHoverBrush, signBrush, playedBrush;
+        QFont   titleFont; // of the live painter. rasterizers lay the title out with it too
+        bool    hasTitleFont = false;
+
+        void update(int fontHeight);
+        void setBackgroundStyle(QPainter *painter) const;
+        void drawBackground(QPainter *painter, const QRectF &rect) const;
+        void paint(QPainter *painter, const QRectF &rect, const AudioMessageFormat &audioFormat, quint32 playPos,
+                   const QStaticText &title) const;
+    };
+    Geometry geometry;
+    int      lastFontSize          = 0;
+    bool     autoFetchMetadata     = false;
+    bool     autoGenerateHistogram = false;
+    bool     autoAdvance           = false;
+
+    std::function<ITEAsyncMediaOpener *(const QUrl &url)> openerResolver; // for restored snapshots
 
     bool isOnButton(const QPoint &pos, const QRect &rect);
-    void updateGeomtry();
+    void drawControls(QPainter *painter, const QRectF &rect, int posInDocument, const QTextFormat &format);
+    void queryMetadata(QTextCursor &cursor, AudioMessageFormat &format); // asks the opener first
+    void fetchMetadata(QTextCursor &cursor, AudioMessageFormat &format); // store, .amplitudes file or generated one
+    void metadataReady(const QUrl &url, const QVariant &metadata);
+    void generateHistogram(QTextCursor &cursor, AudioMessageFormat &format);
+
+    quint32 pixelPosition(qint64 position, qint64 duration) const; // on the scale
+
+    ITEAsyncMediaOpener *asyncOpener(const AudioMessageFormat &format); // sync openers are wrapped with an adapter
+
+    ITEAudioPlayer *createPlayer();
+    ITEAudioPlayer *openPlayer(const AudioMessageFormat &format, int cursorPos);
+    void            setPlayerSource(ITEAudioPlayer *player, const QUrl &url, ITEAsyncMediaOpener *opener,
+                                    QIODevice *stream);
+    void            mediaOpened(ITEAudioPlayer *player, quint32 playerId, ITEAsyncMediaOpener *opener,
+                                const QUrl &url, QIODevice *stream);
+    ITEAudioPlayer *acquirePlayer(quint32 playerId, int cursorPos);
+    void            releasePlayer(quint32 playerId); // closes media and keeps the player for reuse
+    bool            evictPlayer();                   // least recently used not playing one. false if none
+    void            touchPlayer(quint32 playerId);
+    void            routeOutput(quint32 playerId); // pauses other players and gives the output to this one
+    void            seekPending(ITEAudioPlayer *player);
+    void            queueNext(quint32 playerId, int cursorPos); // pre-buffers next element for auto advance
 
 public:
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-    using PlaybackState = QMediaPlayer::State;
-#else
-    using PlaybackState = QMediaPlayer::PlaybackState;
-#endif
+    using PlaybackState = ITEAudioPlayer::State;
 
-    typedef QList<float> Histogram;                     // can be fetched via DeviceOpener::metadata()[amplitudes]
-    static const int     HistogramCompressedSize = 100; // amount of drawn columns
+    typedef QList<float> Histogram; // can be fetched via DeviceOpener::metadata()[amplitudes]
+    static const int     HistogramCompressedSize = HistogramExtractor::CompressedSize;
 
     ITEAudioController(InteractiveText *itc, QObject *parent);
+    ~ITEAudioController();
 
-    QSizeF intrinsicSize(QTextDocument *doc, int posInDocument, const QTextFormat &format);
-    void   drawITE(QPainter *painter, const QRectF &rect, int posInDocument, const QTextFormat &format);
+    QSizeF     intrinsicSize(QTextDocument *doc, int posInDocument, const QTextFormat &format);
+    void       drawITE(QPainter *painter, const QRectF &rect, int posInDocument, const QTextFormat &format);
+    void       drawITEs(QPainter *painter, const QVector<DrawCommand> &commands);
+    Rasterizer rasterizer(const QTextFormat &format);
+    void       elementMemoryUsage(ITEMemoryUsage &usage, const QTextFormat &format) const;
+    void       memoryUsage(ITEMemoryUsage &usage) const;
+
+    QTextCharFormat snapshotFormat(const QTextCharFormat &format) const;
+    void            restoreFormat(QTextCharFormat &format);
+    void            saveState(QDataStream &stream) const; // exact positions of paused elements
+    void            restoreState(QDataStream &stream, const QHash<quint32, quint32> &ids);
+
+    // Media openers are pointers, so snapshots don't keep them (see InteractiveText::saveSnapshot).
+    // Restored elements get the opener the resolver returns for their url. Sync openers have to be wrapped with
+    // ITESyncMediaOpenerAdapter then
+    typedef std::function<ITEAsyncMediaOpener *(const QUrl &url)> OpenerResolver;
+    inline void setOpenerResolver(const OpenerResolver &resolver) { openerResolver = resolver; }
 
     QTextCharFormat makeFormat(const QUrl &audioSrc, ITEMediaOpener *mediaOpener) const;
+    QTextCharFormat makeFormat(const QUrl &audioSrc, ITEAsyncMediaOpener *mediaOpener) const;
     void            insert(const QUrl     &audioSrc,
                            ITEMediaOpener *mediaOpener = nullptr); // add new media to textedit. see QMediaPlayer::setMedia
+    void            insert(const QUrl &audioSrc, ITEAsyncMediaOpener *mediaOpener); // the element shows pending state
     QCursor         cursor();                                      // cursor form after last mose events
 
     inline void setAutoFetchMetadata(bool fetch = true) { autoFetchMetadata = fetch; }
+    // decode local files without amplitudes metadata in background to show their waveform
+    inline void setAutoGenerateHistogram(bool generate = true) { autoGenerateHistogram = generate; }
+    // local files found in the store (see tools/qite-amplitudes) take their histograms from it.
+    // rootPath is the directory the store was generated for
+    bool loadHistogramStore(const QString &fileName, const QString &rootPath);
+    // when an element finishes, continue with the next audio element in the document.
+    // the next one is opened in a second player while the current one plays
+    void setAutoAdvance(bool advance = true);
+
+    // Not playing players over the limit are evicted starting from least recently used ones.
+    // Evicted and idle players continue from the same position on next play.
+    void setMaxPlayers(int count);
+    void setPlayerIdleTimeout(int ms);
+    // max amount of players opened for elements near the viewport. see InteractiveText::setPreloadMargin
+    inline void setPreloadBudget(int count) { preloadBudget = count; }
+
+    // All the players play through one output owned by the controller, so only one element plays at a time.
+    void         setVolume(float volume); // from 0.0 to 1.0
+    inline float volume() const { return outputVolume; }
+    void         setMuted(bool muted);
+    inline bool  isMuted() const { return outputMuted; }
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    void setAudioDevice(const QAudioDevice &device); // null device to follow system default. default backend only
+#endif
+
+    // ITEMediaPlayerBackend is used by default. The controller takes ownership of a backend without a parent.
+    // nullptr restores the default one. Playing elements are stopped.
+    // The default one is created on first use, so controllers which only paint don't open an audio output.
+    void             setBackend(ITEAudioBackend *newBackend);
+    ITEAudioBackend *audioBackend();
+
+    // Random access streams of media openers are read ahead on a worker thread into a buffer of this size.
+    // The streams have to be readable from another thread then. 0 disables it.
+    inline void setReadAheadSize(qint64 bytes) { readAheadSize = bytes; }
+
+    // Stages of playbackLatency() from a click on the play button to the first position report of the playing player.
+    // Skipped stages (e.g. media opened for an already opened player) are -1
+    enum PlaybackStage { ClickStage, MediaOpenedStage, PlayingStage, FirstPositionStage };
+    inline const ITELatencyProbe &playbackLatency() const { return latencyProbe; }
+
+    // Opener's metadata is asked once per url and kept for the controller lifetime.
+    // Urls the opener has no metadata for are asked again only after this timeout.
+    inline void setMetadataNegativeTtl(int ms) { metadataNegativeTtl = ms; }
 
 protected:
     bool mouseEvent(const InteractiveTextElementController::Event &event, const QRect &rect, QTextCursor &selected);
     void hideEvent(QTextCursor &selected);
+    void preloadEvent(QTextCursor &selected);
+    void pageOutEvent(QTextCursor &selected);
+    bool animationFrame(quint32 elementId, qint64 frameTime);
 private slots:
     void playerPositionChanged(qint64);
     void playerStateChanged(PlaybackState);
+    void playerDurationChanged(qint64);
+    void playerMediaStatusChanged(ITEAudioPlayer::MediaStatus status);
+    void playerMetaDataChanged();
+    void reapIdlePlayers();
+    void histogramGenerated(const QUrl &url, const QByteArray &histogram);
+};
+
+// Serves media from memory, for example a short recording made with AudioRecorder::record():
+//     auto url = bufferOpener->add(recorder->data(), recorder->amplitudes());
+//     audioController->insert(url, bufferOpener);
+// The data is shared with the caller and opened streams, so it's never copied.
+class ITEBufferMediaOpener : public ITEMediaOpener {
+public:
+    // suffix is a hint for the player about the media format. compressed amplitudes are optional
+    QUrl add(const QByteArray &data, const QByteArray &amplitudes = QByteArray(),
+             const QString &suffix = QLatin1String("mp4"));
+    void remove(const QUrl &url); // already opened streams keep their data
+
+    QIODevice *open(QUrl &url);
+    void       close(QIODevice *dev);
+    QVariant   metadata(const QUrl &url);
+
+private:
+    struct Entry {
+        QByteArray data;
+        QVariant   metadata;
+    };
+    QHash<QUrl, Entry> _entries;
+    quint32            _lastId = 0;
 };
 
 #endif // QITEAUDIO_H
@@ -0,0 +1,345 @@
+/*
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+#include "qiteaudiobackend.h"
+
+#include <QAudioOutput>
+#include <QMediaMetaData>
+#include <QMediaPlayer>
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+#include <QAudioDevice>
+#include <QMediaDevices>
+#endif
+
+#include <utility>
+
+void ITEAudioPlayer::setNotifyInterval(int ms) { Q_UNUSED(ms) }
+
+//----------------------------------------------------------------------------
+// ITEMediaPlayer
+//----------------------------------------------------------------------------
+ITEMediaPlayer::ITEMediaPlayer(QObject *parent) : ITEAudioPlayer(parent), _player(new QMediaPlayer(this))
+{
+    connect(_player, &QMediaPlayer::positionChanged, this, &ITEAudioPlayer::positionChanged);
+    connect(_player, &QMediaPlayer::durationChanged, this, &ITEAudioPlayer::durationChanged);
+    connect(_player, &QMediaPlayer::mediaStatusChanged, this, [this]() { emit mediaStatusChanged(mediaStatus()); });
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    connect(_player, &QMediaPlayer::stateChanged, this, [this]() { emit stateChanged(state()); });
+    connect(_player, static_cast<void (QMediaObject::*)()>(&QMediaObject::metaDataChanged), this,
+            &ITEAudioPlayer::metaDataChanged);
+    connect(_player, static_cast<void (QMediaPlayer::*)(QMediaPlayer::Error)>(&QMediaPlayer::error), this,
+            [this]() { emit errorOccurred(_player->errorString()); });
+#else
+    connect(_player, &QMediaPlayer::playbackStateChanged, this, [this]() { emit stateChanged(state()); });
+    connect(_player, &QMediaPlayer::metaDataChanged, this, &ITEAudioPlayer::metaDataChanged);
+    connect(_player, &QMediaPlayer::errorOccurred, this, [this](QMediaPlayer::Error error, const QString &errorString) {
+        Q_UNUSED(error);
+        emit errorOccurred(errorString);
+    });
+#endif
+}
+
+void ITEMediaPlayer::setSource(const QUrl &url, QIODevice *stream)
+{
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    if (url.isEmpty()) {
+        _player->setMedia(QMediaContent());
+    } else {
+        _player->setMedia(url, stream);
+    }
+#else
+    if (stream) {
+        _player->setSourceDevice(stream, url);
+    } else {
+        _player->setSource(url);
+    }
+#endif
+}
+
+void ITEMediaPlayer::play() { _player->play(); }
+
+void ITEMediaPlayer::pause() { _player->pause(); }
+
+void ITEMediaPlayer::stop() { _player->stop(); }
+
+void ITEMediaPlayer::setPosition(qint64 ms) { _player->setPosition(ms); }
+
+qint64 ITEMediaPlayer::position() const { return _player->position(); }
+
+qint64 ITEMediaPlayer::duration() const { return _player->duration(); }
+
+ITEAudioPlayer::State ITEMediaPlayer::state() const
+{
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    auto state = _player->state();
+#else
+    auto state = _player->playbackState();
+#endif
+    switch (state) {
+    case QMediaPlayer::PlayingState:
+        return PlayingState;
+    case QMediaPlayer::PausedState:
+        return PausedState;
+    default:
+        return StoppedState;
+    }
+}
+
+ITEAudioPlayer::MediaStatus ITEMediaPlayer::mediaStatus() const
+{
+    switch (_player->mediaStatus()) {
+    case QMediaPlayer::LoadingMedia:
+        return LoadingMedia;
+    case QMediaPlayer::LoadedMedia:
+    case QMediaPlayer::BufferedMedia:
+        return LoadedMedia;
+    case QMediaPlayer::StalledMedia:
+    case QMediaPlayer::BufferingMedia:
+        return BufferingMedia;
+    case QMediaPlayer::EndOfMedia:
+        return EndOfMedia;
+    case QMediaPlayer::InvalidMedia:
+        return InvalidMedia;
+    default:
+        return NoMedia;
+    }
+}
+
+QVariant ITEMediaPlayer::metaData(MetaDataKey key) const
+{
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    return _player->metaData(key == Title ? QMediaMetaData::Title : QMediaMetaData::Comment);
+#else
+    return _player->metaData().value(key == Title ? QMediaMetaData::Title : QMediaMetaData::Comment);
+#endif
+}
+
+void ITEMediaPlayer::setNotifyInterval(int ms)
+{
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    _player->setNotifyInterval(ms);
+#else
+    Q_UNUSED(ms) // Qt6 has fixed interval
+#endif
+}
+
+//----------------------------------------------------------------------------
+// ITEMediaPlayerBackend
+//----------------------------------------------------------------------------
+ITEMediaPlayerBackend::ITEMediaPlayerBackend(QObject *parent) : ITEAudioBackend(parent)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    _audioOutput      = new QAudioOutput(this);
+    auto mediaDevices = new QMediaDevices(this);
+    connect(mediaDevices, &QMediaDevices::audioOutputsChanged, this, [this]() {
+        if (_followDefaultDevice) {
+            _audioOutput->setDevice(QMediaDevices::defaultAudioOutput());
+        }
+    });
+#endif
+}
+
+ITEAudioPlayer *ITEMediaPlayerBackend::createPlayer(QObject *parent)
+{
+    auto player = new ITEMediaPlayer(parent);
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    player->mediaPlayer()->setVolume(qRound(_volume * 100));
+    player->mediaPlayer()->setMuted(_muted);
+    _players.append(player);
+    connect(player, &QObject::destroyed, this, [this, player]() { _players.removeOne(player); });
+#endif
+    return player;
+}
+
+void ITEMediaPlayerBackend::routeOutput(ITEAudioPlayer *player)
+{
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    Q_UNUSED(player) // each player has its own output
+#else
+    auto mp = qobject_cast<ITEMediaPlayer *>(player);
+    if (mp && mp->mediaPlayer()->audioOutput() != _audioOutput) {
+        mp->mediaPlayer()->setAudioOutput(_audioOutput); // it's detached from previous player automatically
+    }
+#endif
+}
+
+void ITEMediaPlayerBackend::setVolume(float volume)
+{
+    _volume = volume;
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    for (auto player : std::as_const(_players)) {
+        player->mediaPlayer()->setVolume(qRound(volume * 100));
+    }
+#else
+    _audioOutput->setVolume(volume);
+#endif
+}
+
+void ITEMediaPlayerBackend::setMuted(bool muted)
+{
+    _muted = muted;
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    for (auto player : std::as_const(_players)) {
+        player->mediaPlayer()->setMuted(muted);
+    }
+#else
+    _audioOutput->setMuted(muted);
+#endif
+}
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+void ITEMediaPlayerBackend::setAudioDevice(const QAudioDevice &device)
+{
+    _followDefaultDevice = device.isNull();
+    _audioOutput->setDevice(_followDefaultDevice ? QMediaDevices::defaultAudioOutput() : device);
+}
+#endif
+
+//----------------------------------------------------------------------------
+// ITEFakeAudioPlayer
+//----------------------------------------------------------------------------
+ITEFakeAudioPlayer::ITEFakeAudioPlayer(ITEFakeAudioBackend *backend, QObject *parent) :
+    ITEAudioPlayer(parent), _backend(backend)
+{
+    _backend->_players.append(this);
+}
+
+ITEFakeAudioPlayer::~ITEFakeAudioPlayer()
+{
+    if (_backend) {
+        _backend->_players.removeOne(this);
+        if (_backend->_audible == this) {
+            _backend->_audible = nullptr;
+        }
+    }
+}
+
+void ITEFakeAudioPlayer::setSource(const QUrl &url, QIODevice *stream)
+{
+    Q_UNUSED(stream)
+    setState(StoppedState);
+    _url      = url;
+    _position = 0;
+    _atEnd    = false;
+
+    qint64 duration = 0;
+    if (!url.isEmpty() && _backend) {
+        duration = _backend->_durations.value(url, _backend->_defaultDuration);
+    }
+    if (duration != _duration) {
+        _duration = duration;
+        emit durationChanged(duration);
+    }
+    emit mediaStatusChanged(mediaStatus());
+    if (_backend && _backend->_metaData.contains(url)) {
+        emit metaDataChanged();
+    }
+}
+
+void ITEFakeAudioPlayer::play()
+{
+    if (_url.isEmpty()) {
+        return;
+    }
+    if (_atEnd) { // like the real players do, start from the beginning
+        _atEnd    = false;
+        _position = 0;
+        emit positionChanged(0);
+    }
+    setState(PlayingState);
+}
+
+void ITEFakeAudioPlayer::pause()
+{
+    if (!_url.isEmpty()) {
+        setState(PausedState);
+    }
+}
+
+void ITEFakeAudioPlayer::stop()
+{
+    setState(StoppedState);
+    if (_position) {
+        _position = 0;
+        emit positionChanged(0);
+    }
+}
+
+void ITEFakeAudioPlayer::setPosition(qint64 ms)
+{
+    _position = qBound(qint64(0), ms, _duration);
+    _atEnd    = false;
+    emit positionChanged(_position);
+}
+
+ITEAudioPlayer::MediaStatus ITEFakeAudioPlayer::mediaStatus() const
+{
+    if (_url.isEmpty()) {
+        return NoMedia;
+    }
+    return _atEnd ? EndOfMedia : LoadedMedia;
+}
+
+QVariant ITEFakeAudioPlayer::metaData(MetaDataKey key) const
+{
+    return _backend ? _backend->_metaData.value(_url).value(int(key)) : QVariant();
+}
+
+void ITEFakeAudioPlayer::advance(qint64 ms)
+{
+    if (_state != PlayingState) {
+        return;
+    }
+    _position = qMin(_position + ms, _duration);
+    emit positionChanged(_position);
+    if (_position >= _duration) {
+        _atEnd = true;
+        emit mediaStatusChanged(EndOfMedia);
+        setState(StoppedState);
+    }
+}
+
+void ITEFakeAudioPlayer::setState(State state)
+{
+    if (_state != state) {
+        _state = state;
+        emit stateChanged(state);
+    }
+}
+
+//----------------------------------------------------------------------------
+// ITEFakeAudioBackend
+//----------------------------------------------------------------------------
+void ITEFakeAudioBackend::advance(qint64 ms)
+{
+    const auto players = _players; // handlers may create or delete players
+    for (auto player : players) {
+        if (_players.contains(player)) {
+            player->advance(ms);
+        }
+    }
+}
+
+ITEAudioPlayer *ITEFakeAudioBackend::createPlayer(QObject *parent) { return new ITEFakeAudioPlayer(this, parent); }
+
+void ITEFakeAudioBackend::routeOutput(ITEAudioPlayer *player) { _audible = player; }
+
+void ITEFakeAudioBackend::setVolume(float volume) { _volume = volume; }
+
+void ITEFakeAudioBackend::setMuted(bool muted) { _muted = muted; }
@@ -0,0 +1,200 @@
+/*
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+#ifndef QITEAUDIOBACKEND_H
+#define QITEAUDIOBACKEND_H
+
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QPointer>
+#include <QUrl>
+#include <QVariant>
+
+class QAudioDevice;
+class QAudioOutput;
+class QIODevice;
+class QMediaPlayer;
+
+// A player of one media at a time. ITEAudioController reuses players for different elements.
+class ITEAudioPlayer : public QObject {
+    Q_OBJECT
+public:
+    enum State { StoppedState, PlayingState, PausedState };
+    enum MediaStatus { NoMedia, LoadingMedia, LoadedMedia, BufferingMedia, EndOfMedia, InvalidMedia };
+    enum MetaDataKey { Title, Comment };
+
+    using QObject::QObject;
+
+    virtual void        setSource(const QUrl &url, QIODevice *stream = nullptr) = 0; // empty url resets the player
+    virtual void        play()                                                   = 0;
+    virtual void        pause()                                                  = 0;
+    virtual void        stop()                                                   = 0;
+    virtual void        setPosition(qint64 ms)                                   = 0;
+    virtual qint64      position() const                                         = 0;
+    virtual qint64      duration() const                                         = 0; // 0 if not known yet
+    virtual State       state() const                                            = 0;
+    virtual MediaStatus mediaStatus() const                                      = 0;
+    virtual QVariant    metaData(MetaDataKey key) const                          = 0;
+    virtual void        setNotifyInterval(int ms); // how often to emit positionChanged. if supported
+
+signals:
+    void positionChanged(qint64 position);
+    void durationChanged(qint64 duration);
+    void stateChanged(ITEAudioPlayer::State state);
+    void mediaStatusChanged(ITEAudioPlayer::MediaStatus status);
+    void metaDataChanged();
+    void errorOccurred(const QString &errorString);
+};
+
+// Creates players and owns the audio output they play through
+class ITEAudioBackend : public QObject {
+    Q_OBJECT
+public:
+    using QObject::QObject;
+
+    virtual ITEAudioPlayer *createPlayer(QObject *parent)       = 0;
+    virtual void            routeOutput(ITEAudioPlayer *player) = 0; // makes the player audible. one at a time
+    virtual void            setVolume(float volume)             = 0; // from 0.0 to 1.0
+    virtual void            setMuted(bool muted)                = 0;
+};
+
+//----------------------------------------------------------------------------
+// QMediaPlayer based backend. The default one
+//----------------------------------------------------------------------------
+class ITEMediaPlayer : public ITEAudioPlayer {
+    Q_OBJECT
+public:
+    explicit ITEMediaPlayer(QObject *parent = nullptr);
+
+    inline QMediaPlayer *mediaPlayer() const { return _player; }
+
+    void        setSource(const QUrl &url, QIODevice *stream = nullptr);
+    void        play();
+    void        pause();
+    void        stop();
+    void        setPosition(qint64 ms);
+    qint64      position() const;
+    qint64      duration() const;
+    State       state() const;
+    MediaStatus mediaStatus() const;
+    QVariant    metaData(MetaDataKey key) const;
+    void        setNotifyInterval(int ms);
+
+private:
+    QMediaPlayer *_player;
+};
+
+class ITEMediaPlayerBackend : public ITEAudioBackend {
+    Q_OBJECT
+public:
+    explicit ITEMediaPlayerBackend(QObject *parent = nullptr);
+
+    ITEAudioPlayer *createPlayer(QObject *parent);
+    void            routeOutput(ITEAudioPlayer *player);
+    void            setVolume(float volume);
+    void            setMuted(bool muted);
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    void setAudioDevice(const QAudioDevice &device); // null device to follow system default
+#endif
+
+private:
+    float _volume = 1.0f;
+    bool  _muted  = false;
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    QList<ITEMediaPlayer *> _players; // Qt5 players have no separate output, so just keep their settings in sync
+#else
+    QAudioOutput *_audioOutput         = nullptr; // shared by all the players
+    bool          _followDefaultDevice = true;
+#endif
+};
+
+//----------------------------------------------------------------------------
+// Deterministic backend without any audio output. Media is "loaded" right in setSource and the time goes
+// only when advance() is called, so playback logic can be run and measured headless.
+//----------------------------------------------------------------------------
+class ITEFakeAudioBackend;
+
+class ITEFakeAudioPlayer : public ITEAudioPlayer {
+    Q_OBJECT
+public:
+    explicit ITEFakeAudioPlayer(ITEFakeAudioBackend *backend, QObject *parent = nullptr);
+    ~ITEFakeAudioPlayer();
+
+    void          setSource(const QUrl &url, QIODevice *stream = nullptr);
+    void          play();
+    void          pause();
+    void          stop();
+    void          setPosition(qint64 ms);
+    inline qint64 position() const { return _position; }
+    inline qint64 duration() const { return _duration; }
+    inline State  state() const { return _state; }
+    MediaStatus   mediaStatus() const;
+    QVariant      metaData(MetaDataKey key) const;
+
+    void advance(qint64 ms); // called by the backend
+
+private:
+    void setState(State state);
+
+private:
+    QPointer<ITEFakeAudioBackend> _backend; // players may outlive it
+    QUrl                          _url;
+    qint64                        _position = 0;
+    qint64                        _duration = 0;
+    State                         _state    = StoppedState;
+    bool                          _atEnd    = false;
+};
+
+class ITEFakeAudioBackend : public ITEAudioBackend {
+    Q_OBJECT
+public:
+    using ITEAudioBackend::ITEAudioBackend;
+
+    inline void setDefaultDuration(qint64 ms) { _defaultDuration = ms; }
+    inline void setDuration(const QUrl &url, qint64 ms) { _durations.insert(url, ms); }
+    inline void setMetaData(const QUrl &url, ITEAudioPlayer::MetaDataKey key, const QVariant &value)
+    {
+        _metaData[url].insert(int(key), value);
+    }
+    void advance(qint64 ms); // moves all playing players forward in time
+
+    inline ITEAudioPlayer *audiblePlayer() const { return _audible; }
+    inline int             playersCount() const { return _players.size(); }
+    inline float           volume() const { return _volume; }
+    inline bool            isMuted() const { return _muted; }
+
+    ITEAudioPlayer *createPlayer(QObject *parent);
+    void            routeOutput(ITEAudioPlayer *player);
+    void            setVolume(float volume);
+    void            setMuted(bool muted);
+
+private:
+    friend class ITEFakeAudioPlayer;
+
+    qint64                            _defaultDuration = 10000;
+    QHash<QUrl, qint64>               _durations;
+    QHash<QUrl, QHash<int, QVariant>> _metaData;
+    QList<ITEFakeAudioPlayer *>       _players;
+    ITEAudioPlayer                   *_audible         = nullptr;
+    float                             _volume          = 1.0f;
+    bool                              _muted           = false;
+};
+
+#endif // QITEAUDIOBACKEND_H
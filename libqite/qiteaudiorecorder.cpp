@@ -19,10 +19,8 @@ under the License.
 
 #include "qiteaudiorecorder.h"
 #include "qiteaudio.h"
+#include "qitehistogram.h"
 
-#include <QAudioBuffer>
-#include <QAudioDecoder>
-#include <QAudioFormat>
 #include <QByteArray>
 #include <QDateTime>
 #include <QDir>
@@ -47,262 +45,13 @@ under the License.
 // #define QITE_DEBUG
 
 namespace {
-const qint64 HistogramQuantumSize = 10000;
-const int    HistogramMemSize     = int(1e6) / HistogramQuantumSize * 20; // for 20 secs. ~ 2Kb
-
-struct Quantum {
-    qint64 timeLeft = HistogramQuantumSize; // to generate next value for aplitude amplitudes
-    qreal  sum      = 0.0;
-    int    count    = 0;
-};
-
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-template <typename T> struct SoloFrameDefault {
-    enum { Default = 0 };
-};
-
-template <typename T> struct SoloFrame {
-
-    SoloFrame() : data(T(SoloFrameDefault<T>::Default)) { }
-
-    SoloFrame(T sample) : data(sample) { }
-
-    SoloFrame &operator=(const SoloFrame &other)
-    {
-        data = other.data;
-        return *this;
-    }
-
-    T data;
-
-    T    average() const { return data; }
-    void clear() { data = T(SoloFrameDefault<T>::Default); }
-};
-#endif
-
+const quint32 StopOperation = 0; // the recorder records one thing at a time
 }
 
-class HistogramExtractor : public QObject {
-    Q_OBJECT
-public:
-    HistogramExtractor(const QUrl &sourceUrl, QObject *parent) : QObject(parent)
-    {
-#ifdef QITE_DEBUG
-        qDebug("Creating histogram extractor for %s", qPrintable(sourceUrl.toString()));
-#endif
-        auto localFile = sourceUrl.toLocalFile();
-        if (!QFileInfo(localFile).exists()) {
-            qFatal("Local file %s doesn't exist", qPrintable(localFile));
-        }
-        _amplitudes.reserve(HistogramMemSize);
-        _decoder = new QAudioDecoder(this);
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-        _decoder->setSourceFilename(sourceUrl.toLocalFile());
-#else
-        _decoder->setSource(sourceUrl);
-
-        // A workaround for a bug https://bugreports.qt.io/browse/QTBUG-123597 (crash if no audio track)
-        _player = new QMediaPlayer(this);
-        QObject::connect(_player, &QMediaPlayer::tracksChanged, this, [this]() {
-            bool hasAudio = _player->audioTracks().size() > 0;
-            _player->stop();
-            if (hasAudio) {
-                _player->deleteLater();
-                startDecoder();
-            } else {
-                doFinish(false, tr("Recorded media lacks audio tracks"));
-            }
-        });
-        _player->setSource(sourceUrl);
-#endif
-    }
-
-    void start()
-    {
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-        startDecoder();
-#else
-        _player->play();
-#endif
-    }
-    inline quint8     maxVolume() const { return _maxVolume; }
-    inline QByteArray amplitudes() const { return _amplitudes; }
-    inline QString    errorString() const { return _errorString; }
-signals:
-    void finished(bool success);
-
-private:
-    void doFinish(bool success, const QString &errorMessage = QString())
-    {
-        _errorString = errorMessage;
-        deleteLater();
-        emit finished(success);
-    }
-
-    void startDecoder()
-    {
-        connect(_decoder, &QAudioDecoder::bufferReady, this, &HistogramExtractor::bufferReady);
-        connect(_decoder, &QAudioDecoder::finished, this, [this]() { doFinish(true); });
-        connect(_decoder, qOverload<QAudioDecoder::Error>(&QAudioDecoder::error), this,
-                [this](QAudioDecoder::Error error) {
-                    Q_UNUSED(error);
-                    doFinish(false, _decoder->errorString());
-                });
-        _decoder->start();
-    }
-
-    template <class T> void handle(const QAudioBuffer &buffer)
-    {
-        auto     format = buffer.format();
-        double   peakvalue; // unreachable value
-        const T *data = buffer.constData<T>();
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-        using FrameDataType = decltype(data[0].average());
-#else
-        using FrameDataType = typename std::decay_t<decltype(data[0])>::value_type;
-#endif
-        if constexpr (std::is_floating_point_v<FrameDataType>) {
-            peakvalue = 1.0003;
-        } else { // integer
-            if constexpr (std::is_signed_v<FrameDataType>) {
-                peakvalue = double(std::numeric_limits<FrameDataType>::max()) + 1;
-            } else {
-                peakvalue = (double(std::numeric_limits<FrameDataType>::max()) + 1) / 2;
-            }
-        }
-
-        int countLeft = format.framesForDuration(_quantum.timeLeft);
-        Q_ASSERT(countLeft > 0);
-        for (int i = 0; i < buffer.frameCount(); i++) {
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-            auto average = qreal(qAbs(data[i].average()));
-#else
-            double sum = 0.0;
-            for (auto value : data[i].channels) {
-                if constexpr (std::is_floating_point_v<FrameDataType> || std::is_signed_v<FrameDataType>) {
-                    sum += std::abs(double(value));
-                } else {
-                    sum += std::abs(double(value) - peakvalue);
-                }
-            }
-            auto average = sum / double(std::size(data[i].channels)); // average over all channels
-#endif
-            // qDebug("%f / %f", average, peakvalue);
-            _quantum.sum += average / peakvalue;
-            _quantum.count++;
-            countLeft--;
-            if (!countLeft) {
-                auto value = quint8((_quantum.sum / qreal(_quantum.count)) * 255.0);
-                if (value > _maxVolume) {
-                    _maxVolume = value;
-                }
-                // qDebug() << int((quantum.sum / qreal(quantum.count)) * 255.0);
-                _amplitudes.append(char(value));
-                if (_amplitudes.size() == _amplitudes.capacity()) {
-                    _amplitudes.reserve(_amplitudes.capacity() + HistogramMemSize);
-                }
-                _quantum  = Quantum();
-                countLeft = format.framesForDuration(_quantum.timeLeft);
-            }
-        }
-        if (countLeft) {
-            _quantum.timeLeft = format.durationForFrames(countLeft);
-        }
-    }
-
-private slots:
-    void bufferReady()
-    {
-        auto buffer = _decoder->read();
-        auto format = buffer.format();
-        if (format.channelCount() > 2) {
-            qWarning("unsupported amount of channels: %d", format.channelCount());
-            return;
-        }
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-        if (format.sampleType() == QAudioFormat::SignedInt) {
-            switch (format.sampleSize()) {
-            case 8:
-                if (format.channelCount() == 2)
-                    handle<QAudioBuffer::S8S>(buffer);
-                else
-                    handle<SoloFrame<signed char>>(buffer);
-                break;
-            case 16:
-                if (format.channelCount() == 2)
-                    handle<QAudioBuffer::S16S>(buffer);
-                else
-                    handle<SoloFrame<signed short>>(buffer);
-                break;
-            }
-        } else if (format.sampleType() == QAudioFormat::UnSignedInt) {
-            switch (format.sampleSize()) {
-            case 8:
-                if (format.channelCount() == 2)
-                    handle<QAudioBuffer::S8U>(buffer);
-                else
-                    handle<SoloFrame<unsigned char>>(buffer);
-                break;
-            case 16:
-                if (format.channelCount() == 2)
-                    handle<QAudioBuffer::S16U>(buffer);
-                else
-                    handle<SoloFrame<unsigned short>>(buffer);
-                break;
-            }
-        } else if (format.sampleType() == QAudioFormat::Float) {
-            if (format.channelCount() == 2)
-                handle<QAudioBuffer::S32F>(buffer);
-            else
-                handle<SoloFrame<float>>(buffer);
-        } else {
-            qWarning("unsupported audio sample type: %d", int(format.sampleType()));
-        }
-
-#else
-        switch (format.sampleFormat()) {
-        case QAudioFormat::UInt8:
-            if (format.channelCount() == 2)
-                handle<QAudioBuffer::U8S>(buffer);
-            else
-                handle<QAudioBuffer::U8M>(buffer);
-            break;
-        case QAudioFormat::Int16:
-            if (format.channelCount() == 2)
-                handle<QAudioBuffer::S16S>(buffer);
-            else
-                handle<QAudioBuffer::S16M>(buffer);
-            break;
-        case QAudioFormat::Int32:
-            if (format.channelCount() == 2)
-                handle<QAudioBuffer::S32S>(buffer);
-            else
-                handle<QAudioBuffer::S32M>(buffer);
-            break;
-        case QAudioFormat::Float:
-            if (format.channelCount() == 2)
-                handle<QAudioBuffer::F32S>(buffer);
-            else
-                handle<QAudioBuffer::F32M>(buffer);
-            break;
-        default:
-            qWarning("unsupported audio sample type: %d", int(format.sampleFormat()));
-        }
-#endif
-    }
-
-private:
-#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
-    QMediaPlayer *_player;
-#endif
-    QString        _errorString;
-    QAudioDecoder *_decoder;
-    quint8         _maxVolume = 0;
-    Quantum        _quantum;
-    QByteArray     _amplitudes;
-};
-
-AudioRecorder::AudioRecorder(QObject *parent) : QObject(parent)
+AudioRecorder::AudioRecorder(QObject *parent) :
+    QObject(parent),
+    _stopLatency({ QLatin1String("stop"), QLatin1String("recorder stopped"), QLatin1String("extractor started"),
+                   QLatin1String("extractor finished"), QLatin1String("finished") })
 {
     _recorder = new QtRecorder(this);
 
@@ -341,6 +90,7 @@ AudioRecorder::AudioRecorder(QObject *parent) : QObject(parent)
         qDebug("State changed %d", recorderState);
 #endif
         if (recorderState == QtRecorder::StoppedState) {
+            _stopLatency.mark(StopOperation, RecorderStoppedStage);
             if (_maxDurationTimer && _maxDurationTimer->isActive()) {
                 delete _maxDurationTimer;
                 _maxDurationTimer = nullptr;
@@ -349,16 +99,20 @@ AudioRecorder::AudioRecorder(QObject *parent) : QObject(parent)
                 auto he = new HistogramExtractor(_recorder->outputLocation(), this); // it's self deletable
                 connect(he, &HistogramExtractor::finished, this, [he, this](bool success) {
                     if (success) {
+                        _stopLatency.mark(StopOperation, ExtractorFinishedStage);
                         postProcess(he->maxVolume(), he->amplitudes());
                     } else {
+                        _stopLatency.cancel(StopOperation);
                         _errorString = he->errorString();
                         _state       = StoppedState;
                         emit finished(false);
                     }
                 });
+                _stopLatency.mark(StopOperation, ExtractorStartedStage);
                 he->start();
                 return;
             }
+            _stopLatency.cancel(StopOperation);
             _errorString = _recorder->errorString();
             _state       = StoppedState;
             emit finished(false);
@@ -430,6 +184,7 @@ void AudioRecorder::recordToFile(const QString &fileName)
 
 void AudioRecorder::stop()
 {
+    _stopLatency.start(StopOperation, StopCallStage);
     _duration = _recorder->duration();
     _recorder->stop();
 }
@@ -459,32 +214,13 @@ void AudioRecorder::postProcess(quint8 maxVolume, const QByteArray &amplitudes)
 {
     _maxVolume = maxVolume;
     if (!_maxVolume) {
+        _stopLatency.cancel(StopOperation);
         _errorString = QLatin1String("Silence recorded");
         _state       = StoppedState;
         emit finished(false);
         return;
     }
-    // compress amplitudes..
-    auto volumeK = 255.0 / double(_maxVolume); // amplificator
-    if (volumeK > 8) {
-        volumeK = 8; // don't be mad on showing silence
-    }
-    auto step = amplitudes.size() / double(ITEAudioController::HistogramCompressedSize);
-    _compressedHistorgram.reserve(ITEAudioController::HistogramCompressedSize);
-
-    for (int i = 0; i < ITEAudioController::HistogramCompressedSize; i++) {
-        int prev = int(step * i);
-        int curr = int(step * (i + 1));
-        if (curr == amplitudes.size()) {
-            curr = amplitudes.size() - 1;
-        }
-
-        int sum = 0;
-        for (int j = prev; j <= curr; j++) {
-            sum += quint8(amplitudes[j]);
-        }
-        _compressedHistorgram.append(int(sum / double(curr - prev + 1) * volumeK));
-    }
+    _compressedHistorgram = HistogramExtractor::compress(_maxVolume, amplitudes);
 
     QStringList columns;
     std::transform(_compressedHistorgram.begin(), _compressedHistorgram.end(), std::back_inserter(columns),
@@ -529,8 +265,7 @@ void AudioRecorder::postProcess(quint8 maxVolume, const QByteArray &amplitudes)
         }
     }
     _state = StoppedState;
+    _stopLatency.mark(StopOperation, FinishedStage);
     emit finished(true);
 #endif
 }
-
-#include "qiteaudiorecorder.moc"
@@ -22,6 +22,8 @@ under the License.
 
 #include <QObject>
 
+#include "qitestats.h"
+
 #if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
 class QAudioRecorder;
 #else
@@ -37,6 +39,14 @@ class AudioRecorder : public QObject {
     Q_OBJECT
 public:
     enum State { StoppedState, RecordingState };
+    // stages of stopLatency() from stop() call to finished() signal
+    enum StopStage {
+        StopCallStage,
+        RecorderStoppedStage,
+        ExtractorStartedStage,
+        ExtractorFinishedStage,
+        FinishedStage
+    };
 
     explicit AudioRecorder(QObject *parent = nullptr);
 
@@ -53,6 +63,8 @@ public:
     inline State   state() const { return _state; }
     inline QString errorString() const { return _errorString; }
 
+    inline const ITELatencyProbe &stopLatency() const { return _stopLatency; }
+
 private:
     void cleanup();
     void postProcess(quint8 maxVolume, const QByteArray &amplitudes);
@@ -80,6 +92,8 @@ private:
     quint8     _maxVolume   = 0;
     State      _state       = StoppedState;
     QString    _errorString;
+
+    ITELatencyProbe _stopLatency;
 };
 
 #endif // QITEAUDIORECORDER_H
@@ -0,0 +1,653 @@
+/*
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+#include "qitehistogram.h"
+
+#include <QAudioBuffer>
+#include <QAudioDecoder>
+#include <QAudioFormat>
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QThread>
+#include <QtEndian>
+#include <cstring>
+#include <utility>
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+#include <QMediaPlayer>
+#endif
+
+// #define QITE_DEBUG
+
+namespace {
+const int     HistogramMemSize = int(1e6) / HistogramExtractor::QuantumDuration * 20; // for 20 secs. ~ 2Kb
+const char    StoreMagic[]     = "QITEAMPL";
+const quint32 StoreVersion     = 1;
+
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+template <typename T> struct SoloFrameDefault {
+    enum { Default = 0 };
+};
+
+template <typename T> struct SoloFrame {
+
+    SoloFrame() : data(T(SoloFrameDefault<T>::Default)) { }
+
+    SoloFrame(T sample) : data(sample) { }
+
+    SoloFrame &operator=(const SoloFrame &other)
+    {
+        data = other.data;
+        return *this;
+    }
+
+    T data;
+
+    T    average() const { return data; }
+    void clear() { data = T(SoloFrameDefault<T>::Default); }
+};
+#endif
+
+}
+
+//----------------------------------------------------------------------------
+// HistogramExtractor
+//----------------------------------------------------------------------------
+HistogramExtractor::HistogramExtractor(const QUrl &sourceUrl, QObject *parent) :
+    QObject(parent), _sourceUrl(sourceUrl)
+{
+#ifdef QITE_DEBUG
+    qDebug("Creating histogram extractor for %s", qPrintable(sourceUrl.toString()));
+#endif
+    auto localFile = sourceUrl.toLocalFile();
+    if (!QFileInfo(localFile).exists()) {
+        _errorString = tr("Local file %1 doesn't exist").arg(localFile); // start() finishes with it
+        return;
+    }
+    _amplitudes.reserve(HistogramMemSize);
+    if (!probeWave(localFile)) {
+        setupDecoder();
+    }
+}
+
+void HistogramExtractor::setupDecoder()
+{
+    _decoder = new QAudioDecoder(this);
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    _decoder->setSourceFilename(_sourceUrl.toLocalFile());
+#else
+    _decoder->setSource(_sourceUrl);
+
+    // A workaround for a bug https://bugreports.qt.io/browse/QTBUG-123597 (crash if no audio track)
+    _player = new QMediaPlayer(this);
+    QObject::connect(_player, &QMediaPlayer::tracksChanged, this, [this]() {
+        bool hasAudio = _player->audioTracks().size() > 0;
+        _player->stop();
+        if (hasAudio) {
+            _player->deleteLater();
+            startDecoder();
+        } else {
+            doFinish(false, tr("Recorded media lacks audio tracks"));
+        }
+    });
+    _player->setSource(_sourceUrl);
+#endif
+}
+
+void HistogramExtractor::start()
+{
+    if (!_errorString.isEmpty()) {
+        QMetaObject::invokeMethod(
+            this, [this]() { doFinish(false, _errorString); }, Qt::QueuedConnection);
+        return;
+    }
+    if (!_decoder) {
+        // keep it asynchronous like the decoder, so the caller doesn't get finished() from inside of start()
+        QMetaObject::invokeMethod(
+            this,
+            [this]() {
+                if (processWave()) {
+                    return;
+                }
+                // mapping failed for some reason. the decoder will do it slower
+                _quantum = Quantum();
+                _amplitudes.clear();
+                _maxVolume = 0;
+                setupDecoder();
+                start();
+            },
+            Qt::QueuedConnection);
+        return;
+    }
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    startDecoder();
+#else
+    _player->play();
+#endif
+}
+
+QByteArray HistogramExtractor::compress(quint8 maxVolume, const QByteArray &amplitudes)
+{
+    QByteArray compressed;
+    if (amplitudes.isEmpty()) {
+        return compressed;
+    }
+    if (!maxVolume) {
+        compressed.fill(0, CompressedSize);
+        return compressed;
+    }
+
+    auto volumeK = 255.0 / double(maxVolume); // amplificator
+    if (volumeK > 8) {
+        volumeK = 8; // don't be mad on showing silence
+    }
+    auto step = amplitudes.size() / double(CompressedSize);
+    compressed.reserve(CompressedSize);
+
+    for (int i = 0; i < CompressedSize; i++) {
+        int prev = int(step * i);
+        int curr = int(step * (i + 1));
+        if (curr == amplitudes.size()) {
+            curr = amplitudes.size() - 1;
+        }
+
+        int sum = 0;
+        for (int j = prev; j <= curr; j++) {
+            sum += quint8(amplitudes[j]);
+        }
+        compressed.append(char(int(sum / double(curr - prev + 1) * volumeK)));
+    }
+    return compressed;
+}
+
+void HistogramExtractor::doFinish(bool success, const QString &errorMessage)
+{
+    _errorString = errorMessage;
+    deleteLater();
+    emit finished(success);
+}
+
+void HistogramExtractor::startDecoder()
+{
+    connect(_decoder, &QAudioDecoder::bufferReady, this, &HistogramExtractor::bufferReady);
+    connect(_decoder, &QAudioDecoder::finished, this, [this]() { doFinish(true); });
+    connect(_decoder, qOverload<QAudioDecoder::Error>(&QAudioDecoder::error), this,
+            [this](QAudioDecoder::Error error) {
+                Q_UNUSED(error);
+                doFinish(false, _decoder->errorString());
+            });
+    _decoder->start();
+}
+
+bool HistogramExtractor::probeWave(const QString &fileName)
+{
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN // samples are used in place, so they have to be in the host byte order
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    char riff[12];
+    if (file.read(riff, qint64(sizeof(riff))) != qint64(sizeof(riff)) || memcmp(riff, "RIFF", 4)
+        || memcmp(riff + 8, "WAVE", 4)) {
+        return false;
+    }
+
+    quint16 formatTag  = 0;
+    quint16 channels   = 0;
+    quint16 sampleBits = 0;
+    quint32 sampleRate = 0;
+    char    header[8]  = {};
+    while (file.read(header, qint64(sizeof(header))) == qint64(sizeof(header))) {
+        auto chunkSize  = qFromLittleEndian<quint32>(header + 4);
+        auto chunkStart = file.pos();
+        if (!memcmp(header, "fmt ", 4)) {
+            auto fmt = file.read(qMin<qint64>(chunkSize, 40));
+            if (fmt.size() < 16) {
+                return false;
+            }
+            formatTag  = qFromLittleEndian<quint16>(fmt.constData());
+            channels   = qFromLittleEndian<quint16>(fmt.constData() + 2);
+            sampleRate = qFromLittleEndian<quint32>(fmt.constData() + 4);
+            sampleBits = qFromLittleEndian<quint16>(fmt.constData() + 14);
+            if (formatTag == 0xFFFE && fmt.size() >= 26) { // WAVE_FORMAT_EXTENSIBLE. subformat GUID starts with the tag
+                formatTag = qFromLittleEndian<quint16>(fmt.constData() + 24);
+            }
+        } else if (!memcmp(header, "data", 4)) {
+            break;
+        }
+        file.seek(chunkStart + chunkSize + (chunkSize & 1)); // chunks are word aligned
+    }
+    if (file.atEnd() || memcmp(header, "data", 4) || !sampleRate || channels < 1 || channels > 2) {
+        return false;
+    }
+
+    QAudioFormat format;
+    format.setSampleRate(int(sampleRate));
+    format.setChannelCount(channels);
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    format.setCodec(QLatin1String("audio/pcm"));
+    format.setByteOrder(QAudioFormat::LittleEndian);
+    format.setSampleSize(sampleBits);
+    if (formatTag == 1 && sampleBits == 8) {
+        format.setSampleType(QAudioFormat::UnSignedInt);
+    } else if (formatTag == 1 && sampleBits == 16) {
+        format.setSampleType(QAudioFormat::SignedInt);
+    } else if (formatTag == 3 && sampleBits == 32) {
+        format.setSampleType(QAudioFormat::Float);
+    } else {
+        return false;
+    }
+#else
+    if (formatTag == 1 && sampleBits == 8) {
+        format.setSampleFormat(QAudioFormat::UInt8);
+    } else if (formatTag == 1 && sampleBits == 16) {
+        format.setSampleFormat(QAudioFormat::Int16);
+    } else if (formatTag == 1 && sampleBits == 32) {
+        format.setSampleFormat(QAudioFormat::Int32);
+    } else if (formatTag == 3 && sampleBits == 32) {
+        format.setSampleFormat(QAudioFormat::Float);
+    } else {
+        return false;
+    }
+#endif
+
+    // size in the header is not reliable for files which were not finalized properly
+    auto dataSize = qMin<qint64>(qFromLittleEndian<quint32>(header + 4), file.size() - file.pos());
+    dataSize -= dataSize % format.bytesPerFrame();
+    if (dataSize <= 0) {
+        return false;
+    }
+    _wave.format     = format;
+    _wave.dataOffset = file.pos();
+    _wave.dataSize   = dataSize;
+    return true;
+#else
+    Q_UNUSED(fileName)
+    return false;
+#endif
+}
+
+bool HistogramExtractor::processWave()
+{
+    QFile file(_sourceUrl.toLocalFile());
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    uchar *data = file.map(_wave.dataOffset, _wave.dataSize);
+    if (!data) {
+        return false;
+    }
+    int sampleBytes = _wave.format.bytesPerFrame() / _wave.format.channelCount();
+    if (quintptr(data) % quintptr(sampleBytes)) { // kernels read samples directly from the mapping
+        file.unmap(data);
+        return false;
+    }
+
+    const int    frameBytes  = _wave.format.bytesPerFrame();
+    const qint64 frames      = _wave.dataSize / frameBytes;
+    const qint64 chunkFrames = 1 << 20; // keeps frame counts in int range for huge files
+    for (qint64 done = 0; done < frames; done += chunkFrames) {
+        process(data + done * frameBytes, int(qMin(chunkFrames, frames - done)), _wave.format);
+    }
+    file.unmap(data);
+    doFinish(true);
+    return true;
+}
+
+template <class T> void HistogramExtractor::handle(const T *data, int frameCount, const QAudioFormat &format)
+{
+    double peakvalue; // unreachable value
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    using FrameDataType = decltype(data[0].average());
+#else
+    using FrameDataType = typename std::decay_t<decltype(data[0])>::value_type;
+#endif
+    if constexpr (std::is_floating_point_v<FrameDataType>) {
+        peakvalue = 1.0003;
+    } else { // integer
+        if constexpr (std::is_signed_v<FrameDataType>) {
+            peakvalue = double(std::numeric_limits<FrameDataType>::max()) + 1;
+        } else {
+            peakvalue = (double(std::numeric_limits<FrameDataType>::max()) + 1) / 2;
+        }
+    }
+
+    int countLeft = format.framesForDuration(_quantum.timeLeft);
+    Q_ASSERT(countLeft > 0);
+    for (int i = 0; i < frameCount; i++) {
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+        auto average = qreal(qAbs(data[i].average()));
+#else
+        double sum = 0.0;
+        for (auto value : data[i].channels) {
+            if constexpr (std::is_floating_point_v<FrameDataType> || std::is_signed_v<FrameDataType>) {
+                sum += std::abs(double(value));
+            } else {
+                sum += std::abs(double(value) - peakvalue);
+            }
+        }
+        auto average = sum / double(std::size(data[i].channels)); // average over all channels
+#endif
+        // qDebug("%f / %f", average, peakvalue);
+        _quantum.sum += average / peakvalue;
+        _quantum.count++;
+        countLeft--;
+        if (!countLeft) {
+            auto value = quint8((_quantum.sum / qreal(_quantum.count)) * 255.0);
+            if (value > _maxVolume) {
+                _maxVolume = value;
+            }
+            // qDebug() << int((quantum.sum / qreal(quantum.count)) * 255.0);
+            _amplitudes.append(char(value));
+            if (_amplitudes.size() == _amplitudes.capacity()) {
+                _amplitudes.reserve(_amplitudes.capacity() + HistogramMemSize);
+            }
+            _quantum  = Quantum();
+            countLeft = format.framesForDuration(_quantum.timeLeft);
+        }
+    }
+    if (countLeft) {
+        _quantum.timeLeft = format.durationForFrames(countLeft);
+    }
+}
+
+void HistogramExtractor::bufferReady()
+{
+    auto buffer = _decoder->read();
+    process(buffer.constData<char>(), buffer.frameCount(), buffer.format());
+}
+
+void HistogramExtractor::process(const void *data, int frameCount, const QAudioFormat &format)
+{
+    if (format.channelCount() > 2) {
+        qWarning("unsupported amount of channels: %d", format.channelCount());
+        return;
+    }
+#define QITE_HANDLE(T) handle(static_cast<const T *>(data), frameCount, format)
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    if (format.sampleType() == QAudioFormat::SignedInt) {
+        switch (format.sampleSize()) {
+        case 8:
+            if (format.channelCount() == 2)
+                QITE_HANDLE(QAudioBuffer::S8S);
+            else
+                QITE_HANDLE(SoloFrame<signed char>);
+            break;
+        case 16:
+            if (format.channelCount() == 2)
+                QITE_HANDLE(QAudioBuffer::S16S);
+            else
+                QITE_HANDLE(SoloFrame<signed short>);
+            break;
+        }
+    } else if (format.sampleType() == QAudioFormat::UnSignedInt) {
+        switch (format.sampleSize()) {
+        case 8:
+            if (format.channelCount() == 2)
+                QITE_HANDLE(QAudioBuffer::S8U);
+            else
+                QITE_HANDLE(SoloFrame<unsigned char>);
+            break;
+        case 16:
+            if (format.channelCount() == 2)
+                QITE_HANDLE(QAudioBuffer::S16U);
+            else
+                QITE_HANDLE(SoloFrame<unsigned short>);
+            break;
+        }
+    } else if (format.sampleType() == QAudioFormat::Float) {
+        if (format.channelCount() == 2)
+            QITE_HANDLE(QAudioBuffer::S32F);
+        else
+            QITE_HANDLE(SoloFrame<float>);
+    } else {
+        qWarning("unsupported audio sample type: %d", int(format.sampleType()));
+    }
+
+#else
+    switch (format.sampleFormat()) {
+    case QAudioFormat::UInt8:
+        if (format.channelCount() == 2)
+            QITE_HANDLE(QAudioBuffer::U8S);
+        else
+            QITE_HANDLE(QAudioBuffer::U8M);
+        break;
+    case QAudioFormat::Int16:
+        if (format.channelCount() == 2)
+            QITE_HANDLE(QAudioBuffer::S16S);
+        else
+            QITE_HANDLE(QAudioBuffer::S16M);
+        break;
+    case QAudioFormat::Int32:
+        if (format.channelCount() == 2)
+            QITE_HANDLE(QAudioBuffer::S32S);
+        else
+            QITE_HANDLE(QAudioBuffer::S32M);
+        break;
+    case QAudioFormat::Float:
+        if (format.channelCount() == 2)
+            QITE_HANDLE(QAudioBuffer::F32S);
+        else
+            QITE_HANDLE(QAudioBuffer::F32M);
+        break;
+    default:
+        qWarning("unsupported audio sample type: %d", int(format.sampleFormat()));
+    }
+#endif
+#undef QITE_HANDLE
+}
+
+//----------------------------------------------------------------------------
+// HistogramGenerator
+//----------------------------------------------------------------------------
+HistogramGenerator::HistogramGenerator(QObject *parent) :
+    QObject(parent), _maxThreads(qMax(1, QThread::idealThreadCount() / 2))
+{
+}
+
+HistogramGenerator::~HistogramGenerator()
+{
+    for (auto thread : std::as_const(_threads)) {
+        thread->quit();
+    }
+    for (auto thread : std::as_const(_threads)) {
+        thread->wait();
+    }
+}
+
+bool HistogramGenerator::request(const QUrl &url)
+{
+    if (!url.isLocalFile()) {
+        return false;
+    }
+    if (_cache.contains(url) || _inProgress.contains(url) || _queue.contains(url)) {
+        return true;
+    }
+    _queue.append(url);
+    startNext();
+    return true;
+}
+
+bool HistogramGenerator::cancel(const QUrl &url) { return _queue.removeOne(url); }
+
+bool HistogramGenerator::cached(const QUrl &url, QByteArray *histogram) const
+{
+    auto it = _cache.constFind(url);
+    if (it == _cache.constEnd()) {
+        return false;
+    }
+    if (histogram) {
+        *histogram = it.value();
+    }
+    return true;
+}
+
+qint64 HistogramGenerator::cacheBytes() const
+{
+    qint64 bytes = 0;
+    for (auto it = _cache.constBegin(); it != _cache.constEnd(); ++it) {
+        // a node with the url and the histogram. url's string and the array headers are about 64 bytes
+        bytes += sizeof(QUrl) + sizeof(QByteArray) + 64 + it.key().toString().size() * 2 + it.value().size();
+    }
+    return bytes;
+}
+
+void HistogramGenerator::startNext()
+{
+    if (_threads.isEmpty()) {
+        for (int i = 0; i < _maxThreads; i++) {
+            auto thread = new QThread(this);
+            thread->setObjectName(QString::fromLatin1("qite-histogram-%1").arg(i));
+            auto worker = new QObject; // just a context for the thread
+            worker->moveToThread(thread);
+            connect(thread, &QThread::finished, worker, &QObject::deleteLater);
+            thread->start(QThread::LowPriority);
+            _threads.append(thread);
+            _idleWorkers.append(worker);
+        }
+    }
+
+    while (!_idleWorkers.isEmpty() && !_queue.isEmpty()) {
+        auto url    = _queue.takeFirst();
+        auto worker = _idleWorkers.takeLast();
+        _inProgress.insert(url);
+        QMetaObject::invokeMethod(
+            worker,
+            [this, worker, url]() {
+                // executed in the worker thread. the extractor is a child of the worker to be cleaned up with it
+                auto extractor = new HistogramExtractor(url, worker);
+                connect(
+                    extractor, &HistogramExtractor::finished, extractor,
+                    [this, worker, url, extractor](bool success) {
+                        QByteArray histogram;
+                        if (success) {
+                            histogram = HistogramExtractor::compress(extractor->maxVolume(), extractor->amplitudes());
+                        }
+                        QMetaObject::invokeMethod(
+                            this, [this, worker, url, histogram]() { jobFinished(worker, url, histogram); },
+                            Qt::QueuedConnection);
+                    },
+                    Qt::DirectConnection);
+                extractor->start();
+            },
+            Qt::QueuedConnection);
+    }
+}
+
+void HistogramGenerator::jobFinished(QObject *worker, const QUrl &url, const QByteArray &histogram)
+{
+#ifdef QITE_DEBUG
+    qDebug("Histogram generated for %s: %s", qPrintable(url.toString()), histogram.isEmpty() ? "failure" : "success");
+#endif
+    _inProgress.remove(url);
+    _cache.insert(url, histogram);
+    _idleWorkers.append(worker);
+    emit finished(url, histogram);
+    startNext();
+}
+
+HistogramStore::HistogramStore(const QString &rootPath) : _root(rootPath) { }
+
+bool HistogramStore::load(const QString &fileName)
+{
+    _entries.clear();
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QDataStream ds(&f);
+    QByteArray  magic;
+    quint32     version = 0, count = 0;
+    ds >> magic >> version >> count;
+    if (magic != StoreMagic || version != StoreVersion) {
+        return false;
+    }
+    _entries.reserve(int(count));
+    for (quint32 i = 0; i < count && ds.status() == QDataStream::Ok; i++) {
+        QString path;
+        Entry   entry;
+        ds >> path >> entry.mtime >> entry.histogram;
+        _entries.insert(path, entry);
+    }
+    if (ds.status() != QDataStream::Ok) {
+        _entries.clear();
+        return false;
+    }
+    return true;
+}
+
+bool HistogramStore::save(const QString &fileName) const
+{
+    QSaveFile f(fileName);
+    if (!f.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    QDataStream ds(&f);
+    ds << QByteArray(StoreMagic) << StoreVersion << quint32(_entries.size());
+    for (auto it = _entries.constBegin(); it != _entries.constEnd(); ++it) {
+        ds << it.key() << it.value().mtime << it.value().histogram;
+    }
+    return ds.status() == QDataStream::Ok && f.commit();
+}
+
+bool HistogramStore::find(const QString &fileName, QByteArray *histogram) const
+{
+    auto it = _entries.constFind(_root.relativeFilePath(fileName));
+    if (it == _entries.constEnd() || it->mtime != QFileInfo(fileName).lastModified().toMSecsSinceEpoch()) {
+        return false; // the file was modified after the store was written
+    }
+    if (histogram) {
+        *histogram = it->histogram;
+    }
+    return true;
+}
+
+void HistogramStore::insert(const QString &fileName, const QByteArray &histogram)
+{
+    Entry entry;
+    entry.mtime     = QFileInfo(fileName).lastModified().toMSecsSinceEpoch();
+    entry.histogram = histogram;
+    _entries.insert(_root.relativeFilePath(fileName), entry);
+}
+
+int HistogramStore::prune()
+{
+    int removed = 0;
+    for (auto it = _entries.begin(); it != _entries.end();) {
+        if (QFileInfo::exists(_root.absoluteFilePath(it.key()))) {
+            ++it;
+        } else {
+            it = _entries.erase(it);
+            removed++;
+        }
+    }
+    return removed;
+}
+
+qint64 HistogramStore::bytes() const
+{
+    qint64 bytes = 0;
+    for (auto it = _entries.constBegin(); it != _entries.constEnd(); ++it) {
+        // like in HistogramGenerator::cacheBytes()
+        bytes += sizeof(QString) + sizeof(Entry) + 64 + it.key().size() * 2 + it.value().histogram.size();
+    }
+    return bytes;
+}
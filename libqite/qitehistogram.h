@@ -0,0 +1,159 @@
+/*
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+#ifndef QITEHISTOGRAM_H
+#define QITEHISTOGRAM_H
+
+#include <QAudioFormat>
+#include <QByteArray>
+#include <QDir>
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QSet>
+#include <QUrl>
+
+class QAudioDecoder;
+class QMediaPlayer;
+class QThread;
+
+// Decodes a local audio file and computes its amplitudes. Self-deletable once finished.
+// PCM WAV files are mapped into memory and analyzed in place, everything else goes through QAudioDecoder.
+class HistogramExtractor : public QObject {
+    Q_OBJECT
+public:
+    static constexpr qint64 QuantumDuration = 10000; // microseconds of audio per amplitude value
+    static constexpr int    CompressedSize  = 100;   // amount of drawn columns
+
+    HistogramExtractor(const QUrl &sourceUrl, QObject *parent = nullptr);
+
+    void              start();
+    inline quint8     maxVolume() const { return _maxVolume; }
+    inline QByteArray amplitudes() const { return _amplitudes; }
+    inline QString    errorString() const { return _errorString; }
+
+    // compresses raw amplitudes to CompressedSize columns normalized by max volume
+    static QByteArray compress(quint8 maxVolume, const QByteArray &amplitudes);
+
+signals:
+    void finished(bool success);
+
+private:
+    struct Quantum {
+        qint64 timeLeft = QuantumDuration; // to generate next value for aplitude amplitudes
+        qreal  sum      = 0.0;
+        int    count    = 0;
+    };
+
+    struct WaveData {
+        QAudioFormat format;
+        qint64       dataOffset = 0;
+        qint64       dataSize   = 0; // 0 if it's not a supported PCM WAV file
+    };
+
+    void doFinish(bool success, const QString &errorMessage = QString());
+    void setupDecoder();
+    void startDecoder();
+    bool probeWave(const QString &fileName);
+    bool processWave();
+    void process(const void *data, int frameCount, const QAudioFormat &format);
+
+    template <class T> void handle(const T *data, int frameCount, const QAudioFormat &format);
+
+private slots:
+    void bufferReady();
+
+private:
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    QMediaPlayer *_player = nullptr;
+#endif
+    QUrl           _sourceUrl;
+    QString        _errorString;
+    QAudioDecoder *_decoder   = nullptr;
+    quint8         _maxVolume = 0;
+    Quantum        _quantum;
+    QByteArray     _amplitudes;
+    WaveData       _wave;
+};
+
+// Generates compressed histograms for local audio files on a bounded set of background threads.
+// Each file is decoded at most once per generator lifetime, failures are remembered too.
+class HistogramGenerator : public QObject {
+    Q_OBJECT
+public:
+    explicit HistogramGenerator(QObject *parent = nullptr);
+    ~HistogramGenerator();
+
+    inline void setMaxThreads(int count) { _maxThreads = count > 0 ? count : 1; } // set it before first request
+
+    bool request(const QUrl &url); // returns false if url is not a local file
+    bool cancel(const QUrl &url);  // removes not yet started request. returns true on success
+    bool cached(const QUrl &url, QByteArray *histogram = nullptr) const;
+
+    inline int cacheSize() const { return _cache.size(); }
+    qint64     cacheBytes() const; // approximate memory held by the cache
+
+signals:
+    void finished(const QUrl &url, const QByteArray &histogram); // empty histogram on failure
+
+private:
+    void startNext();
+    void jobFinished(QObject *worker, const QUrl &url, const QByteArray &histogram);
+
+private:
+    int                     _maxThreads;
+    QList<QThread *>        _threads;
+    QList<QObject *>        _idleWorkers; // one per thread, lives in its thread
+    QList<QUrl>             _queue;
+    QSet<QUrl>              _inProgress;
+    QHash<QUrl, QByteArray> _cache;
+};
+
+// Compressed histograms of a tree of audio files in one binary file (see tools/qite-amplitudes --store).
+// Layout (QDataStream): QByteArray magic ("QITEAMPL"), quint32 version, quint32 count,
+//   count * { QString relativePath, qint64 sourceMTimeMsecs, QByteArray histogram }
+// Entries are keyed by the path relative to the tree root and are valid until the source file is modified.
+class HistogramStore {
+public:
+    explicit HistogramStore(const QString &rootPath = QString());
+
+    bool load(const QString &fileName); // replaces current entries. false if the file is missing or broken
+    bool save(const QString &fileName) const;
+
+    bool find(const QString &fileName, QByteArray *histogram = nullptr) const; // only up to date entries
+    void insert(const QString &fileName, const QByteArray &histogram);         // takes mtime of the file
+    int  prune(); // removes entries of deleted files. returns amount of removed ones
+
+    inline void    setRootPath(const QString &rootPath) { _root.setPath(rootPath); }
+    inline QString rootPath() const { return _root.absolutePath(); }
+    inline bool    isEmpty() const { return _entries.isEmpty(); }
+    inline int     size() const { return _entries.size(); }
+    qint64         bytes() const; // approximate memory held by the entries
+
+private:
+    struct Entry {
+        qint64     mtime = 0; // msecs since epoch
+        QByteArray histogram;
+    };
+
+    QDir                  _root;
+    QHash<QString, Entry> _entries;
+};
+
+#endif // QITEHISTOGRAM_H
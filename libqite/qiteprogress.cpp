@@ -30,7 +30,7 @@ under the License.
 class ProgressMessageFormat : public InteractiveTextFormat {
 public:
     enum Property {
-        Text,
+        Text = InteractiveTextFormat::UserProperty, // 0 would be QTextFormat::ObjectIndex
         MinValue,
         MaxValue,
         CurrentValue, /* in pixels */
@@ -118,37 +118,48 @@ void ITEProgressController::updateGeomtry()
     scaleRect     = QRectF(scaleTopLeft, scaleBottomRight);
     scaleFillRect = scaleRect.adjusted(scaleOutlineWidth / 2, scaleOutlineWidth / 2, -scaleOutlineWidth / 2,
                                        -scaleOutlineWidth / 2);
+
+    bgPen = QPen(QColor(100, 200, 100)); // TODO name all the magic colors
+    bgPen.setWidth(bgOutlineWidth);
+    bgBrush          = QBrush(QColor(150, 250, 150));
+    buttonBrush      = QBrush(QColor(120, 220, 120));
+    buttonHoverBrush = QBrush(QColor(130, 230, 130));
+    signPen          = QPen(QColor(Qt::white));
+    signPen.setWidth(bgOutlineWidth);
+    signBrush = QBrush(QColor(Qt::white));
+    scalePen  = QPen(QColor(100, 200, 100));
+    scalePen.setWidth(scaleOutlineWidth);
+    playedBrush = QBrush(QColor(170, 255, 170));
+    textPen     = QPen(QColor(70, 150, 70));
 }
 
 void ITEProgressController::drawITE(QPainter *painter, const QRectF &rect, [[maybe_unused]] int posInDocument,
                                     const QTextFormat &format)
 {
+    if (isLowDetail()) {
+        painter->fillRect(bgRect.translated(int(rect.left()), int(rect.top())), bgBrush);
+        return;
+    }
+    // pens and brushes are made with the geometry. so nothing is allocated here
     const ProgressMessageFormat audioFormat = ProgressMessageFormat::fromCharFormat(format.toCharFormat());
     // qDebug() << audioFormat.id();
+    auto state = audioFormat.state();
 
     painter->setRenderHints(QPainter::Antialiasing);
 
-    QPen bgPen(QColor(100, 200, 100)); // TODO name all the magic colors
-    bgPen.setWidth(bgOutlineWidth);
     painter->setPen(bgPen);
-    painter->setBrush(QColor(150, 250, 150));
+    painter->setBrush(bgBrush);
     painter->drawRoundedRect(bgRect.translated(int(rect.left()), int(rect.top())), bgRectRadius, bgRectRadius);
 
     // draw button
-    if (audioFormat.state() & ProgressMessageFormat::MouseOnButton) {
-        painter->setBrush(QColor(130, 230, 130));
-    } else {
-        painter->setBrush(QColor(120, 220, 120));
-    }
+    painter->setBrush(state & ProgressMessageFormat::MouseOnButton ? buttonHoverBrush : buttonBrush);
     auto xBtnCenter = btnCenter + rect.topLeft();
     painter->drawEllipse(xBtnCenter, btnRadius, btnRadius);
 
     // draw pause/play
-    QPen signPen((QColor(Qt::white)));
-    signPen.setWidth(bgOutlineWidth);
     painter->setPen(signPen);
-    painter->setBrush(QColor(Qt::white));
-    bool isPlaying = audioFormat.state() & ProgressMessageFormat::Playing;
+    painter->setBrush(signBrush);
+    bool isPlaying = state & ProgressMessageFormat::Playing;
     if (isPlaying) {
         QRectF bar(0, 0, signSize / 3, signSize * 2);
         bar.moveCenter(xBtnCenter - QPointF(signSize / 2, 0));
@@ -162,10 +173,8 @@ void ITEProgressController::drawITE(QPainter *painter, const QRectF &rect, [[may
     }
 
     // draw scale
-    QPen scalePen(QColor(100, 200, 100));
-    scalePen.setWidth(scaleOutlineWidth);
     painter->setPen(scalePen);
-    painter->setBrush(QColor(120, 220, 120));
+    painter->setBrush(buttonBrush);
     QRectF xScaleRect(scaleRect.translated(rect.topLeft()));
     painter->drawRoundedRect(xScaleRect, scaleRect.height() / 2, scaleRect.height() / 2);
 
@@ -173,28 +182,31 @@ void ITEProgressController::drawITE(QPainter *painter, const QRectF &rect, [[may
     auto playPos = audioFormat.currentValue();
     if (playPos) {
         painter->setPen(Qt::NoPen);
-        painter->setBrush(QColor(170, 255, 170));
+        painter->setBrush(playedBrush);
         QRectF playedRect(scaleFillRect.translated(rect.topLeft())); // to the width of the scale border
         playedRect.setWidth(playPos);
         painter->drawRoundedRect(playedRect, playedRect.height() / 2, playedRect.height() / 2);
     }
 
-    painter->setPen(QColor(70, 150, 70));
-    painter->drawText(metaRect.translated(rect.topLeft().toPoint()), audioFormat.text());
+    painter->setPen(textPen);
+    painter->drawStaticText(metaRect.translated(rect.topLeft().toPoint()).topLeft(),
+                            staticText(audioFormat.id(), audioFormat.text(), painter->font(), metaRect.width()));
 }
 
 QTextCharFormat ITEProgressController::makeFormat() const
 {
     ProgressMessageFormat fmt(objectType, itc->nextId());
-    fmt.setFontPointSize(itc->textEdit()->currentFont().pointSize());
+    fmt.setFontPointSize(itc->defaultFont().pointSize());
     return fmt;
 }
 
-void ITEProgressController::insert([[maybe_unused]] double min, [[maybe_unused]] double max,
-                                   [[maybe_unused]] const QString &text)
+void ITEProgressController::insert(double min, double max, const QString &text)
 {
-    auto fmt = makeFormat();
-    itc->insert(static_cast<InteractiveTextFormat>(fmt));
+    ProgressMessageFormat fmt(makeFormat());
+    fmt.setMinValue(min);
+    fmt.setMaxValue(max);
+    fmt.setProperty(ProgressMessageFormat::Text, text);
+    itc->insert(fmt);
 }
 
 bool ITEProgressController::mouseEvent(const Event &event, const QRect &rect, QTextCursor &selected)
@@ -277,7 +289,7 @@ bool ITEProgressController::mouseEvent(const Event &event, const QRect &rect, QT
                             }
                             quint32     playerId      = player->property("playerId").toUInt();
                             int         textCursorPos = player->property("cursorPos").toInt();
-                            QTextCursor cursor        = itc->findElement(playerId, textCursorPos);
+                            QTextCursor cursor        = findElement(playerId, textCursorPos);
                             if (cursor.isNull()) {
                                 return;
                             }
@@ -319,7 +331,7 @@ bool ITEProgressController::mouseEvent(const Event &event, const QRect &rect, QT
 
                                 quint32     playerId      = player->property("playerId").toUInt();
                                 int         textCursorPos = player->property("cursorPos").toInt();
-                                QTextCursor cursor        = itc->findElement(playerId, textCursorPos);
+                                QTextCursor cursor        = findElement(playerId, textCursorPos);
                                 if (cursor.isNull()) {
                                     return;
                                 }
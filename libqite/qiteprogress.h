@@ -20,8 +20,10 @@ under the License.
 #ifndef QITEPROGRESS_H
 #define QITEPROGRESS_H
 
+#include <QBrush>
 #include <QCursor>
 #include <QObject>
+#include <QPen>
 
 #include "qite.h"
 
@@ -42,6 +44,8 @@ class ITEProgressController : public InteractiveTextElementController {
     int     signSize;
     int     scaleOutlineWidth;
     QRectF  scaleRect, scaleFillRect;
+    QPen    bgPen, signPen, scalePen, textPen;
+    QBrush  bgBrush, buttonBrush, buttonHoverBrush, signBrush, playedBrush;
     int     lastFontSize = 0;
 
     bool isOnButton(const QPoint &pos, const QRect &rect);
@@ -0,0 +1,208 @@
+/*
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+#include "qitereadahead.h"
+
+#include <QMutexLocker>
+#include <QThread>
+
+#include <cstring>
+
+namespace {
+const qint64 MaxChunkSize = 64 * 1024; // max size of a single read from the source
+}
+
+ITEReadAheadDevice::ITEReadAheadDevice(QIODevice *source, qint64 bufferSize, QObject *parent) :
+    QIODevice(parent), _source(source), _sequential(source->isSequential()), _size(source->size()),
+    _ring(size_t(qMax(bufferSize, MaxChunkSize)))
+{
+}
+
+ITEReadAheadDevice::~ITEReadAheadDevice() { close(); }
+
+bool ITEReadAheadDevice::open(OpenMode mode)
+{
+    if ((mode & ReadWrite) != ReadOnly || !_source->isReadable()) {
+        return false;
+    }
+    _start  = _sequential ? 0 : _source->pos();
+    _begin  = 0;
+    _count  = 0;
+    _refill = false;
+    _eof    = false;
+    _error  = false;
+    _stop   = false;
+    // we have our own buffer. don't let QIODevice copy the data once more
+    if (!QIODevice::open(mode | Unbuffered)) {
+        return false;
+    }
+    if (!_sequential && _start) {
+        QIODevice::seek(_start);
+    }
+    _worker = QThread::create([this]() { fill(); });
+    _worker->start();
+    return true;
+}
+
+void ITEReadAheadDevice::close()
+{
+    if (_worker) {
+        {
+            QMutexLocker locker(&_mutex);
+            _stop = true;
+            _wakeWorker.wakeAll();
+            _dataReady.wakeAll();
+        }
+        _worker->wait();
+        delete _worker;
+        _worker = nullptr;
+    }
+    if (isOpen()) {
+        QIODevice::close();
+    }
+}
+
+bool ITEReadAheadDevice::isSequential() const { return _sequential; }
+
+qint64 ITEReadAheadDevice::size() const { return _size; }
+
+bool ITEReadAheadDevice::seek(qint64 pos)
+{
+    if (_sequential || pos < 0 || !QIODevice::seek(pos)) {
+        return false;
+    }
+    QMutexLocker locker(&_mutex);
+    if (pos >= _start && pos <= _start + _count) {
+        // already buffered. just skip it
+        auto skip = pos - _start;
+        _begin    = (_begin + skip) % qint64(_ring.size());
+        _count -= skip;
+        _start = pos;
+        _wakeWorker.wakeAll();
+    } else {
+        reset(pos);
+    }
+    return true;
+}
+
+bool ITEReadAheadDevice::atEnd() const
+{
+    QMutexLocker locker(&_mutex);
+    return _eof && !_count;
+}
+
+qint64 ITEReadAheadDevice::bytesAvailable() const
+{
+    QMutexLocker locker(&_mutex);
+    return _count; // QIODevice buffer is not used
+}
+
+qint64 ITEReadAheadDevice::readData(char *data, qint64 maxSize)
+{
+    QMutexLocker locker(&_mutex);
+    while (!_count && !_eof && !_stop) {
+        _dataReady.wait(&_mutex);
+    }
+    if (!_count) {
+        return _error ? -1 : 0;
+    }
+
+    auto ringSize = qint64(_ring.size());
+    auto toRead   = qMin(maxSize, _count);
+    auto first    = qMin(toRead, ringSize - _begin); // up to the end of the ring
+    std::memcpy(data, _ring.data() + _begin, size_t(first));
+    if (first < toRead) {
+        std::memcpy(data + first, _ring.data(), size_t(toRead - first));
+    }
+    _begin = (_begin + toRead) % ringSize;
+    _count -= toRead;
+    _start += toRead;
+    _wakeWorker.wakeAll();
+    return toRead;
+}
+
+qint64 ITEReadAheadDevice::writeData(const char *data, qint64 maxSize)
+{
+    Q_UNUSED(data)
+    Q_UNUSED(maxSize)
+    return -1;
+}
+
+void ITEReadAheadDevice::reset(qint64 pos)
+{
+    _begin  = 0;
+    _count  = 0;
+    _start  = pos;
+    _refill = true;
+    _eof    = false;
+    _error  = false;
+    _epoch++;
+    _wakeWorker.wakeAll();
+}
+
+void ITEReadAheadDevice::fill()
+{
+    auto         ringSize = qint64(_ring.size());
+    QMutexLocker locker(&_mutex);
+    while (!_stop) {
+        if (_refill) {
+            _refill     = false;
+            auto epoch  = _epoch;
+            auto target = _start;
+            locker.unlock();
+            bool sought = _source->seek(target);
+            locker.relock();
+            if (epoch != _epoch) {
+                continue; // one more seek in the meantime
+            }
+            if (!sought) {
+                _eof   = true;
+                _error = true;
+                _dataReady.wakeAll();
+            }
+            continue;
+        }
+        if (_eof || _count == ringSize) {
+            _wakeWorker.wait(&_mutex);
+            continue;
+        }
+
+        // the free space after the unread data is not touched by the reader, so it's fine to write it unlocked
+        auto tail     = (_begin + _count) % ringSize;
+        auto toRead   = qMin(qMin(ringSize - _count, ringSize - tail), MaxChunkSize);
+        auto epoch    = _epoch;
+        bool wasEmpty = !_count;
+        locker.unlock();
+        auto bytes = _source->read(_ring.data() + tail, toRead);
+        locker.relock();
+        if (epoch != _epoch) {
+            continue; // the data is outdated already
+        }
+        if (bytes <= 0) {
+            _eof   = true;
+            _error = bytes < 0;
+        } else {
+            _count += bytes;
+        }
+        _dataReady.wakeAll();
+        if (wasEmpty && bytes > 0) {
+            QMetaObject::invokeMethod(this, "readyRead", Qt::QueuedConnection);
+        }
+    }
+}
@@ -0,0 +1,83 @@
+/*
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+#ifndef QITEREADAHEAD_H
+#define QITEREADAHEAD_H
+
+#include <QIODevice>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <vector>
+
+class QThread;
+
+// Read-only device which reads its source ahead on a worker thread into a bounded ring buffer,
+// so slow sources (decryption, network storage etc) don't block the decoder on each read.
+// After open() the source is accessed only from the worker thread, so it must not rely on its thread's event loop.
+// Seeks within the buffered data are served from memory, others restart filling from the new position.
+class ITEReadAheadDevice : public QIODevice {
+    Q_OBJECT
+public:
+    static const qint64 DefaultBufferSize = 1024 * 1024;
+
+    // the source has to be opened for reading. it's not owned and not closed by this device
+    explicit ITEReadAheadDevice(QIODevice *source, qint64 bufferSize = DefaultBufferSize, QObject *parent = nullptr);
+    ~ITEReadAheadDevice();
+
+    inline QIODevice *source() const { return _source; }
+
+    bool   open(OpenMode mode) override; // only ReadOnly is supported
+    void   close() override;
+    bool   isSequential() const override;
+    qint64 size() const override;
+    bool   seek(qint64 pos) override;
+    bool   atEnd() const override;
+    qint64 bytesAvailable() const override;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 maxSize) override;
+
+private:
+    void fill(); // worker thread loop
+    void reset(qint64 pos);
+
+private:
+    QIODevice        *_source;
+    QThread          *_worker = nullptr;
+    bool              _sequential;
+    qint64            _size;
+    std::vector<char> _ring;
+
+    // guarded by the mutex
+    mutable QMutex _mutex;
+    QWaitCondition _dataReady;   // reader waits for the worker
+    QWaitCondition _wakeWorker;  // worker waits for free space or a seek
+    qint64         _begin   = 0; // ring index of the first unread byte
+    qint64         _count   = 0; // amount of unread bytes in the ring
+    qint64         _start   = 0; // stream position of the first unread byte
+    quint32        _epoch   = 0; // incremented on each refill, so the worker drops outdated reads
+    bool           _refill  = false;
+    bool           _eof     = false;
+    bool           _error   = false;
+    bool           _stop    = false;
+};
+
+#endif // QITEREADAHEAD_H
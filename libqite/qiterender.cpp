@@ -0,0 +1,69 @@
+/*
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+#include "qiterender.h"
+#include "qite.h"
+
+#include <QPainter>
+#include <QTextDocument>
+#include <QThreadPool>
+
+#include <cmath>
+
+ITEDocumentRenderer::ITEDocumentRenderer(QObject *parent) : QObject(parent), _pool(new QThreadPool(this)) { }
+
+ITEDocumentRenderer::~ITEDocumentRenderer()
+{
+    // the jobs post their results to this object
+    _pool->clear();
+    _pool->waitForDone();
+}
+
+void ITEDocumentRenderer::setMaxThreads(int count) { _pool->setMaxThreadCount(qMax(1, count)); }
+
+quint32 ITEDocumentRenderer::render(const Setup &setup, int width, qreal devicePixelRatio)
+{
+    auto job = ++_lastJob;
+    _pool->start([this, job, setup, width, devicePixelRatio]() {
+        auto image = renderImage(setup, width, devicePixelRatio);
+        QMetaObject::invokeMethod(
+            this, [this, job, image]() { emit finished(job, image); }, Qt::QueuedConnection);
+    });
+    return job;
+}
+
+bool ITEDocumentRenderer::waitForDone(int msecs) { return _pool->waitForDone(msecs); }
+
+QImage ITEDocumentRenderer::renderImage(const Setup &setup, int width, qreal devicePixelRatio)
+{
+    // the document outlives the controllers which are children of itc
+    QTextDocument   document;
+    InteractiveText itc(&document);
+    document.setTextWidth(width);
+    setup(&document, &itc);
+
+    QSizeF size(width, std::ceil(document.size().height()));
+    QImage image((size * devicePixelRatio).toSize(), QImage::Format_ARGB32_Premultiplied);
+    image.setDevicePixelRatio(devicePixelRatio);
+    image.fill(Qt::transparent);
+    QPainter painter(&image);
+    painter.setRenderHint(QPainter::Antialiasing);
+    itc.render(&painter, QRectF(QPointF(0, 0), size));
+    return image;
+}
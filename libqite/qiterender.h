@@ -0,0 +1,61 @@
+/*
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+#ifndef QITERENDER_H
+#define QITERENDER_H
+
+#include <QImage>
+#include <QObject>
+
+#include <functional>
+
+class InteractiveText;
+class QTextDocument;
+class QThreadPool;
+
+// Renders documents with interactive elements into images, e.g. for previews and export of chat transcripts.
+// Each job builds its own document, widget-less InteractiveText and controllers with the setup function in a worker
+// thread, so independent documents share nothing and render in parallel. The setup function has to create
+// the controllers with InteractiveText as a parent (or delete them itself) and fill the document.
+// Controllers can't wait for anything there, so elements are painted with what their formats have.
+class ITEDocumentRenderer : public QObject {
+    Q_OBJECT
+public:
+    typedef std::function<void(QTextDocument *document, InteractiveText *itc)> Setup;
+
+    explicit ITEDocumentRenderer(QObject *parent = nullptr);
+    ~ITEDocumentRenderer(); // waits for started jobs
+
+    void setMaxThreads(int count); // QThread::idealThreadCount() by default
+
+    // returns id of the job passed to finished(). the document is laid out with the width in pixels
+    quint32 render(const Setup &setup, int width, qreal devicePixelRatio = 1.0);
+    bool    waitForDone(int msecs = -1);
+
+    static QImage renderImage(const Setup &setup, int width, qreal devicePixelRatio = 1.0); // in the calling thread
+
+signals:
+    void finished(quint32 job, const QImage &image);
+
+private:
+    QThreadPool *_pool;
+    quint32      _lastJob = 0;
+};
+
+#endif // QITERENDER_H
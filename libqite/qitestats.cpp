@@ -0,0 +1,372 @@
+/*
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+#include "qitestats.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QIODevice>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextFormat>
+#include <QThread>
+#include <QUrl>
+#include <QVariant>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+namespace {
+const char *const CounterNames[InteractiveTextStats::CounterCount]
+    = { "eventFilterCalls", "hitTests",          "findElementHintHits", "findElementScans",        "findElementScanned",
+        "visibilityChecks", "visibilityVisited", "charFormatWrites",    "metadataRequestsInFlight" };
+const char *const TimerNames[InteractiveTextStats::TimerCount] = { "eventFilter", "trackVisibility", "drawITE" };
+
+// offscreen rendering may paint elements on worker threads. the stats are about the GUI
+bool isGuiThread()
+{
+    auto app = QCoreApplication::instance();
+    return !app || QThread::currentThread() == app->thread();
+}
+
+QString formatSize(qint64 bytes)
+{
+    if (bytes < 1024) {
+        return QString::fromLatin1("%1 B").arg(bytes);
+    }
+    if (bytes < 1024 * 1024) {
+        return QString::fromLatin1("%1 KiB").arg(bytes / 1024.0, 0, 'f', 1);
+    }
+    return QString::fromLatin1("%1 MiB").arg(bytes / (1024.0 * 1024.0), 0, 'f', 1);
+}
+}
+
+InteractiveTextStats::InteractiveTextStats() { _clock.start(); }
+
+InteractiveTextStats *InteractiveTextStats::instance()
+{
+    static InteractiveTextStats stats;
+    return &stats;
+}
+
+QHash<QByteArray, InteractiveTextStats::TimerStats> InteractiveTextStats::drawTimers() const
+{
+    QHash<QByteArray, TimerStats> ret;
+    for (auto it = _drawTimers.constBegin(); it != _drawTimers.constEnd(); ++it) {
+        ret.insert(QByteArray(it.key()), it.value());
+    }
+    return ret;
+}
+
+void InteractiveTextStats::reset()
+{
+    for (auto &c : _counters) {
+        c = 0;
+    }
+    for (auto &t : _timers) {
+        t = TimerStats();
+    }
+    _drawTimers.clear();
+    _trace.clear();
+    _traceNext = 0;
+}
+
+void InteractiveTextStats::setTraceCapacity(int maxEvents)
+{
+    _traceCapacity = qMax(0, maxEvents);
+    _trace.clear();
+    _trace.reserve(_traceCapacity);
+    _traceNext = 0;
+}
+
+void InteractiveTextStats::add(Counter c, qint64 value)
+{
+    if (!isGuiThread()) {
+        return;
+    }
+    _counters[c] += value;
+    if (_traceCapacity) {
+        trace({ now(), _counters[c], CounterNames[c], nullptr, true });
+    }
+}
+
+void InteractiveTextStats::addTime(Timer t, qint64 startNs, const char *detail)
+{
+    if (!isGuiThread()) {
+        return;
+    }
+    auto  duration = now() - startNs;
+    auto &stats    = _timers[t];
+    stats.count++;
+    stats.totalNs += duration;
+    stats.maxNs = qMax(stats.maxNs, duration);
+    if (t == DrawITE && detail) {
+        auto &ds = _drawTimers[detail];
+        ds.count++;
+        ds.totalNs += duration;
+        ds.maxNs = qMax(ds.maxNs, duration);
+    }
+    if (_traceCapacity) {
+        trace({ startNs, duration, TimerNames[t], detail, false });
+    }
+}
+
+void InteractiveTextStats::trace(const TraceEvent &event)
+{
+    if (_trace.size() < _traceCapacity) {
+        _trace.append(event);
+    } else {
+        _trace[_traceNext] = event; // overwrite the oldest one
+        _traceNext         = (_traceNext + 1) % _traceCapacity;
+    }
+}
+
+bool InteractiveTextStats::writeChromeTrace(QIODevice *device) const
+{
+    QJsonArray events;
+    for (int i = 0; i < _trace.size(); i++) {
+        auto const &e = _trace[(_traceNext + i) % _trace.size()]; // from the oldest one
+        QJsonObject event;
+        event.insert(QLatin1String("name"), QLatin1String(e.name));
+        event.insert(QLatin1String("cat"), QLatin1String("qite"));
+        event.insert(QLatin1String("pid"), 1);
+        event.insert(QLatin1String("tid"), 1);
+        event.insert(QLatin1String("ts"), e.time / 1000.0); // microseconds
+        if (e.isCounter) {
+            event.insert(QLatin1String("ph"), QLatin1String("C"));
+            event.insert(QLatin1String("args"), QJsonObject { { QLatin1String("value"), double(e.value) } });
+        } else {
+            event.insert(QLatin1String("ph"), QLatin1String("X"));
+            event.insert(QLatin1String("dur"), e.value / 1000.0);
+            if (e.detail) {
+                event.insert(QLatin1String("args"),
+                             QJsonObject { { QLatin1String("controller"), QLatin1String(e.detail) } });
+            }
+        }
+        events.append(event);
+    }
+    QJsonObject root;
+    root.insert(QLatin1String("traceEvents"), events);
+    root.insert(QLatin1String("displayTimeUnit"), QLatin1String("ns"));
+    return device->write(QJsonDocument(root).toJson(QJsonDocument::Compact)) != -1;
+}
+
+//----------------------------------------------------------------------------
+// ITELatencyProbe
+//----------------------------------------------------------------------------
+ITELatencyProbe::ITELatencyProbe(const QStringList &stageNames, int window) :
+    _stageNames(stageNames), _window(qMax(1, window))
+{
+    _clock.start();
+}
+
+void ITELatencyProbe::start(quint32 operation, int firstStage)
+{
+    Record record;
+    record.started = QDateTime::currentMSecsSinceEpoch();
+    record.stages.fill(-1, _stageNames.size());
+    if (firstStage >= 0 && firstStage < record.stages.size()) {
+        record.stages[firstStage] = 0;
+    }
+    _inProgress.insert(operation, record);
+    _startTimes.insert(operation, _clock.nsecsElapsed());
+}
+
+void ITELatencyProbe::mark(quint32 operation, int stage)
+{
+    auto it = _inProgress.find(operation);
+    if (it == _inProgress.end() || stage < 0 || stage >= it->stages.size() || it->stages[stage] != -1) {
+        return;
+    }
+    it->stages[stage] = (_clock.nsecsElapsed() - _startTimes.value(operation)) / 1000;
+    if (stage == it->stages.size() - 1) {
+        _records.append(*it);
+        while (_records.size() > _window) {
+            _records.removeFirst();
+        }
+        _inProgress.erase(it);
+        _startTimes.remove(operation);
+    }
+}
+
+void ITELatencyProbe::cancel(quint32 operation)
+{
+    _inProgress.remove(operation);
+    _startTimes.remove(operation);
+}
+
+bool ITELatencyProbe::isMarked(quint32 operation, int stage) const
+{
+    auto it = _inProgress.constFind(operation);
+    return it != _inProgress.constEnd() && stage >= 0 && stage < it->stages.size() && it->stages[stage] != -1;
+}
+
+QList<ITELatencyProbe::Record> ITELatencyProbe::records() const { return _records; }
+
+qint64 ITELatencyProbe::percentile(int stage, double p) const
+{
+    QVector<qint64> values;
+    values.reserve(_records.size());
+    for (auto const &r : _records) {
+        if (stage >= 0 && stage < r.stages.size() && r.stages[stage] != -1) {
+            values.append(r.stages[stage]);
+        }
+    }
+    if (values.isEmpty()) {
+        return -1;
+    }
+    std::sort(values.begin(), values.end());
+    // nearest rank
+    int rank = int(std::ceil(qBound(0.0, p, 100.0) / 100.0 * values.size()));
+    return values[qBound(0, rank - 1, values.size() - 1)];
+}
+
+QString ITELatencyProbe::summary() const
+{
+    QStringList lines;
+    for (int i = 0; i < _stageNames.size(); i++) {
+        auto p50 = percentile(i, 50);
+        if (p50 == -1) {
+            continue;
+        }
+        lines.append(QString::fromLatin1("%1: p50 %2 ms, p90 %3 ms, p99 %4 ms")
+                         .arg(_stageNames[i])
+                         .arg(p50 / 1000.0, 0, 'f', 1)
+                         .arg(percentile(i, 90) / 1000.0, 0, 'f', 1)
+                         .arg(percentile(i, 99) / 1000.0, 0, 'f', 1));
+    }
+    return lines.join(QLatin1Char('\n'));
+}
+
+//----------------------------------------------------------------------------
+// ITEMemoryUsage
+//----------------------------------------------------------------------------
+void ITEMemoryUsage::add(const QString &category, qint64 bytes, qint64 entries)
+{
+    auto &c = _categories[category];
+    c.bytes += bytes;
+    c.entries += entries;
+    _total += bytes;
+}
+
+void ITEMemoryUsage::addElement(const QString &category, quint32 elementId, qint64 bytes)
+{
+    add(category, bytes);
+    _elements[elementId] += bytes;
+}
+
+QList<QPair<quint32, qint64>> ITEMemoryUsage::topElements(int count) const
+{
+    QList<QPair<quint32, qint64>> elements;
+    elements.reserve(_elements.size());
+    for (auto it = _elements.constBegin(); it != _elements.constEnd(); ++it) {
+        elements.append(qMakePair(it.key(), it.value()));
+    }
+    count = qBound(0, count, elements.size());
+    std::partial_sort(elements.begin(), elements.begin() + count, elements.end(),
+                      [](const QPair<quint32, qint64> &a, const QPair<quint32, qint64> &b) {
+                          return a.second > b.second;
+                      });
+    return elements.mid(0, count);
+}
+
+QString ITEMemoryUsage::dump(int topCount) const
+{
+    QStringList lines;
+    lines.append(QString::fromLatin1("total: %1, elements: %2").arg(formatSize(_total)).arg(_elements.size()));
+
+    QList<QPair<qint64, QString>> categories; // the biggest first
+    for (auto it = _categories.constBegin(); it != _categories.constEnd(); ++it) {
+        categories.append(qMakePair(it->bytes, it.key()));
+    }
+    std::sort(categories.begin(), categories.end(), std::greater<QPair<qint64, QString>>());
+    for (auto const &c : std::as_const(categories)) {
+        const auto category = _categories.value(c.second);
+        lines.append(QString::fromLatin1("  %1: %2 in %3 entries (%4 each)")
+                         .arg(c.second, formatSize(category.bytes))
+                         .arg(category.entries)
+                         .arg(formatSize(category.entries ? category.bytes / category.entries : 0)));
+    }
+
+    auto top = topElements(topCount);
+    if (!top.isEmpty()) {
+        lines.append(QString::fromLatin1("top %1 elements:").arg(top.size()));
+        for (auto const &e : std::as_const(top)) {
+            lines.append(QString::fromLatin1("  #%1: %2").arg(e.first).arg(formatSize(e.second)));
+        }
+    }
+    return lines.join(QLatin1Char('\n'));
+}
+
+qint64 ITEMemoryUsage::stringBytes(const QString &s)
+{
+    return s.isNull() ? 0 : DataHeader + (s.capacity() + 1) * qint64(sizeof(QChar));
+}
+
+qint64 ITEMemoryUsage::byteArrayBytes(const QByteArray &a) { return a.isNull() ? 0 : DataHeader + a.capacity() + 1; }
+
+qint64 ITEMemoryUsage::variantBytes(const QVariant &v)
+{
+    qint64 bytes = sizeof(QVariant);
+    switch (v.userType()) {
+    case QMetaType::QString:
+        return bytes + stringBytes(v.toString());
+    case QMetaType::QByteArray:
+        return bytes + byteArrayBytes(v.toByteArray());
+    case QMetaType::QUrl:
+        return bytes + DataHeader + stringBytes(v.toUrl().toString()); // it keeps the parts separately. close enough
+    case QMetaType::QStringList: {
+        const auto list = v.toStringList();
+        bytes += DataHeader + list.size() * qint64(sizeof(QString));
+        for (auto const &item : list) {
+            bytes += stringBytes(item);
+        }
+        return bytes;
+    }
+    case QMetaType::QVariantList: {
+        const auto list = v.toList();
+        bytes += DataHeader;
+        for (auto const &item : list) {
+            bytes += variantBytes(item);
+        }
+        return bytes;
+    }
+    case QMetaType::QVariantMap: {
+        const auto map = v.toMap();
+        for (auto it = map.constBegin(); it != map.constEnd(); ++it) {
+            bytes += NodeOverhead + stringBytes(it.key()) + variantBytes(it.value());
+        }
+        return bytes;
+    }
+    default:
+        return bytes;
+    }
+}
+
+qint64 ITEMemoryUsage::formatBytes(const QTextFormat &format)
+{
+    const auto properties = format.properties();
+    qint64     bytes      = sizeof(QTextFormat) + DataHeader; // the private data is a vector of key-value pairs
+    for (auto it = properties.constBegin(); it != properties.constEnd(); ++it) {
+        bytes += sizeof(qint32) + variantBytes(it.value());
+    }
+    return bytes;
+}
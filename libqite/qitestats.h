@@ -0,0 +1,191 @@
+/*
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+#ifndef QITESTATS_H
+#define QITESTATS_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QPair>
+#include <QStringList>
+#include <QVector>
+
+class QIODevice;
+class QTextFormat;
+class QVariant;
+
+// Hot-path counters and timers of InteractiveText and the element controllers.
+// They are collected only if the library is built with QITE_STATS defined (see libqite.cmake / libqite.pri),
+// otherwise the macros below compile to nothing and all the values stay zero. Calls from other threads are ignored.
+class InteractiveTextStats {
+public:
+    enum Counter {
+        EventFilterCalls,
+        HitTests,            // document layout hit tests
+        FindElementHintHits, // element found at the position hint
+        FindElementScans,    // full document scans
+        FindElementScanned,  // elements looked at by the scans
+        VisibilityChecks,
+        VisibilityVisited, // elements checked by trackVisibility
+        CharFormatWrites,  // format-only changes of the document
+        MetadataRequestsInFlight,
+        CounterCount
+    };
+    enum Timer { EventFilter, TrackVisibility, DrawITE, TimerCount };
+
+    struct TimerStats {
+        qint64 count   = 0;
+        qint64 totalNs = 0;
+        qint64 maxNs   = 0;
+    };
+
+    static InteractiveTextStats *instance();
+
+    inline qint64                 counter(Counter c) const { return _counters[c]; }
+    inline const TimerStats      &timer(Timer t) const { return _timers[t]; }
+    QHash<QByteArray, TimerStats> drawTimers() const; // DrawITE split by controller class
+    void                          reset();
+
+    // Keeps up to maxEvents last timings and counter changes for writeChromeTrace. 0 (default) disables it.
+    void setTraceCapacity(int maxEvents);
+    // Chrome's Trace Event Format. Open it with chrome://tracing or ui.perfetto.dev
+    bool writeChromeTrace(QIODevice *device) const;
+
+    void          add(Counter c, qint64 value = 1);
+    inline qint64 now() const { return _clock.nsecsElapsed(); }
+    void          addTime(Timer t, qint64 startNs, const char *detail = nullptr);
+
+    class ScopedTimer {
+    public:
+        inline ScopedTimer(Timer t, const char *detail = nullptr) :
+            _timer(t), _detail(detail), _start(instance()->now())
+        {
+        }
+        inline ~ScopedTimer() { instance()->addTime(_timer, _start, _detail); }
+
+    private:
+        Timer       _timer;
+        const char *_detail;
+        qint64      _start;
+    };
+
+private:
+    InteractiveTextStats();
+
+    struct TraceEvent {
+        qint64      time;  // ns
+        qint64      value; // duration for timers, new value for counters
+        const char *name;
+        const char *detail;
+        bool        isCounter;
+    };
+    void trace(const TraceEvent &event);
+
+    QElapsedTimer                   _clock;
+    qint64                          _counters[CounterCount] = {};
+    TimerStats                      _timers[TimerCount];
+    QHash<const char *, TimerStats> _drawTimers; // by class name from the meta object. so the pointers are stable
+    QVector<TraceEvent>             _trace;      // ring buffer
+    int                             _traceCapacity = 0;
+    int                             _traceNext     = 0;
+};
+
+// Latency breakdown of multi-stage operations, like from a click to the sound. Unlike the stats above it's always on.
+// Each stage is timed from the start of its operation. Only the first mark of a stage counts. Marking the last
+// stage finishes the operation, skipped stages are left at -1. Percentiles are computed over the last finished ones.
+class ITELatencyProbe {
+public:
+    struct Record {
+        qint64          started; // QDateTime::currentMSecsSinceEpoch()
+        QVector<qint64> stages;  // microseconds since the start
+    };
+
+    explicit ITELatencyProbe(const QStringList &stageNames, int window = 100);
+
+    void start(quint32 operation, int firstStage = 0); // restarts the operation if it's in progress
+    void mark(quint32 operation, int stage);           // ignored for operations which were not started
+    void cancel(quint32 operation);
+    bool isMarked(quint32 operation, int stage) const;
+
+    inline const QStringList &stageNames() const { return _stageNames; }
+    QList<Record>             records() const;                       // finished ones, oldest first
+    qint64                    percentile(int stage, double p) const; // microseconds. -1 if there is no data
+    QString                   summary() const;                       // p50/p90/p99 of each stage
+
+private:
+    QStringList            _stageNames;
+    int                    _window;
+    QElapsedTimer          _clock;
+    QHash<quint32, Record> _inProgress;
+    QHash<quint32, qint64> _startTimes; // _clock nsecs
+    QList<Record>          _records;
+};
+
+// Estimate of memory held by InteractiveText and its controllers by category. See InteractiveText::memoryUsage.
+// It's payload sizes plus a fixed overhead per container item. Implicitly shared data is counted by each holder and
+// memory of Qt internals (text layout, media decoders and outputs) is not counted at all.
+class ITEMemoryUsage {
+public:
+    struct Category {
+        qint64 bytes   = 0;
+        qint64 entries = 0;
+    };
+
+    static const int DataHeader   = 2 * sizeof(void *); // QString, QByteArray, QList etc
+    static const int NodeOverhead = 3 * sizeof(void *); // per item of hash based containers
+
+    void add(const QString &category, qint64 bytes, qint64 entries = 1); // not bound to an element
+    void addElement(const QString &category, quint32 elementId, qint64 bytes);
+
+    inline qint64                         total() const { return _total; }
+    inline const QMap<QString, Category> &categories() const { return _categories; }
+    inline qint64                         elementBytes(quint32 elementId) const { return _elements.value(elementId); }
+    QList<QPair<quint32, qint64>>         topElements(int count) const;  // largest first
+    QString                               dump(int topCount = 10) const; // totals by category and top elements
+
+    static qint64        stringBytes(const QString &s);
+    static qint64        byteArrayBytes(const QByteArray &a);
+    static qint64        variantBytes(const QVariant &v);       // just sizeof(QVariant) for unknown types
+    static qint64        formatBytes(const QTextFormat &format); // all the properties
+    static inline qint64 nodesBytes(qint64 count, qint64 itemSize) { return count * (itemSize + NodeOverhead); }
+
+private:
+    QMap<QString, Category> _categories;
+    QHash<quint32, qint64>  _elements;
+    qint64                  _total = 0;
+};
+
+#ifdef QITE_STATS
+#define QITE_STATS_ADD(counter, value) InteractiveTextStats::instance()->add(InteractiveTextStats::counter, value)
+#define QITE_STATS_TIMER(timer, detail)                                                                                \
+    InteractiveTextStats::ScopedTimer qiteStatsTimer(InteractiveTextStats::timer, detail)
+#else
+// arguments aren't evaluated. so they must not have side effects
+#define QITE_STATS_ADD(counter, value)                                                                                 \
+    do {                                                                                                               \
+    } while (false)
+#define QITE_STATS_TIMER(timer, detail)                                                                                \
+    do {                                                                                                               \
+    } while (false)
+#endif
+
+#endif // QITESTATS_H
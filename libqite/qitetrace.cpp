@@ -0,0 +1,254 @@
+/*
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+#include "qitetrace.h"
+
+#include <QCoreApplication>
+#include <QHoverEvent>
+#include <QIODevice>
+#include <QMouseEvent>
+#include <QResizeEvent>
+#include <QScrollBar>
+#include <QTextEdit>
+#include <QTimer>
+
+const char ITEInputTrace::Magic[] = "QITEINPT";
+
+namespace {
+ITEInputTrace::Kind kindOf(QEvent::Type type)
+{
+    switch (type) {
+    case QEvent::HoverEnter:
+        return ITEInputTrace::HoverEnter;
+    case QEvent::HoverMove:
+        return ITEInputTrace::HoverMove;
+    case QEvent::HoverLeave:
+        return ITEInputTrace::HoverLeave;
+    case QEvent::MouseButtonPress:
+        return ITEInputTrace::MousePress;
+    case QEvent::MouseButtonRelease:
+        return ITEInputTrace::MouseRelease;
+    case QEvent::MouseButtonDblClick:
+        return ITEInputTrace::MouseDoubleClick;
+    case QEvent::MouseMove:
+        return ITEInputTrace::MouseMove;
+    case QEvent::Resize:
+        return ITEInputTrace::Resize;
+    default:
+        return ITEInputTrace::KindCount;
+    }
+}
+
+QEvent::Type typeOf(ITEInputTrace::Kind kind)
+{
+    switch (kind) {
+    case ITEInputTrace::HoverEnter:
+        return QEvent::HoverEnter;
+    case ITEInputTrace::HoverMove:
+        return QEvent::HoverMove;
+    case ITEInputTrace::HoverLeave:
+        return QEvent::HoverLeave;
+    case ITEInputTrace::MousePress:
+        return QEvent::MouseButtonPress;
+    case ITEInputTrace::MouseRelease:
+        return QEvent::MouseButtonRelease;
+    case ITEInputTrace::MouseDoubleClick:
+        return QEvent::MouseButtonDblClick;
+    case ITEInputTrace::MouseMove:
+        return QEvent::MouseMove;
+    default:
+        return QEvent::None;
+    }
+}
+}
+
+//----------------------------------------------------------------------------
+// ITEInputTraceWriter
+//----------------------------------------------------------------------------
+ITEInputTraceWriter::ITEInputTraceWriter(QIODevice *device) : _stream(device)
+{
+    _stream << QByteArray(ITEInputTrace::Magic) << ITEInputTrace::Version;
+    _clock.start();
+}
+
+void ITEInputTraceWriter::write(ITEInputTrace::Kind kind, const QPoint &point, quint8 button, quint8 buttons)
+{
+    auto now = _clock.elapsed();
+    _stream << quint32(now - _lastTime) << quint8(kind) << qint32(point.x()) << qint32(point.y()) << button << buttons;
+    _lastTime = now;
+}
+
+bool ITEInputTraceWriter::writeEvent(QEvent *event, bool viewport)
+{
+    auto kind = kindOf(event->type());
+    switch (kind) {
+    case ITEInputTrace::HoverEnter:
+    case ITEInputTrace::HoverMove:
+    case ITEInputTrace::HoverLeave:
+        if (viewport) {
+            return false;
+        }
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+        write(kind, static_cast<QHoverEvent *>(event)->pos());
+#else
+        write(kind, static_cast<QHoverEvent *>(event)->position().toPoint());
+#endif
+        return true;
+    case ITEInputTrace::MousePress:
+    case ITEInputTrace::MouseRelease:
+    case ITEInputTrace::MouseDoubleClick:
+    case ITEInputTrace::MouseMove: {
+        if (!viewport) {
+            return false;
+        }
+        auto me = static_cast<QMouseEvent *>(event);
+        write(kind, me->pos(), quint8(me->button()), quint8(me->buttons()));
+        return true;
+    }
+    case ITEInputTrace::Resize: {
+        if (viewport) {
+            return false;
+        }
+        auto size = static_cast<QResizeEvent *>(event)->size();
+        write(kind, QPoint(size.width(), size.height()));
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+//----------------------------------------------------------------------------
+// ITEInputReplayer
+//----------------------------------------------------------------------------
+ITEInputReplayer::ITEInputReplayer(QTextEdit *textEdit, QObject *parent) :
+    QObject(parent), _textEdit(textEdit), _timer(new QTimer(this))
+{
+    _timer->setSingleShot(true);
+    _timer->setTimerType(Qt::PreciseTimer);
+    connect(_timer, &QTimer::timeout, this, &ITEInputReplayer::replayNext);
+}
+
+bool ITEInputReplayer::load(QIODevice *device)
+{
+    QDataStream ds(device);
+    QByteArray  magic;
+    quint32     version;
+    ds >> magic >> version;
+    if (magic != ITEInputTrace::Magic || version != ITEInputTrace::Version) {
+        return false;
+    }
+
+    stop();
+    _records.clear();
+    _times.clear();
+    qint64 time = 0;
+    while (!ds.atEnd()) {
+        ITEInputTrace::Record record;
+        quint8                kind;
+        qint32                x, y;
+        ds >> record.delay >> kind >> x >> y >> record.button >> record.buttons;
+        if (ds.status() != QDataStream::Ok || kind >= ITEInputTrace::KindCount) {
+            break; // likely the recording application didn't finish it. the rest is still good
+        }
+        record.kind  = ITEInputTrace::Kind(kind);
+        record.point = QPoint(x, y);
+        time += record.delay;
+        _records.append(record);
+        _times.append(time);
+    }
+    return true;
+}
+
+void ITEInputReplayer::start()
+{
+    stop();
+    _next    = 0;
+    _running = true;
+    _clock.start();
+    _timer->start(0);
+}
+
+void ITEInputReplayer::stop()
+{
+    _timer->stop();
+    _running = false;
+}
+
+void ITEInputReplayer::replayNext()
+{
+    if (!_textEdit) {
+        _next = _records.size();
+    } else if (_speed > 0) {
+        auto now = qint64(_clock.elapsed() * _speed); // in the trace time
+        while (_next < _records.size() && _times[_next] <= now) {
+            dispatch(_records[_next++]);
+        }
+        if (_next < _records.size()) {
+            _timer->start(int((_times[_next] - now) / _speed));
+            return;
+        }
+    } else if (_next < _records.size()) {
+        dispatch(_records[_next++]);
+    }
+
+    if (_next < _records.size()) {
+        _timer->start(0);
+        return;
+    }
+    _running = false;
+    emit finished();
+}
+
+void ITEInputReplayer::dispatch(const ITEInputTrace::Record &record)
+{
+    switch (record.kind) {
+    case ITEInputTrace::HoverEnter:
+    case ITEInputTrace::HoverMove:
+    case ITEInputTrace::HoverLeave: {
+#if QT_VERSION < QT_VERSION_CHECK(6, 3, 0)
+        QHoverEvent event(typeOf(record.kind), record.point, _lastHoverPos);
+#else
+        QHoverEvent event(typeOf(record.kind), record.point, _textEdit->mapToGlobal(record.point), _lastHoverPos);
+#endif
+        _lastHoverPos = record.point;
+        QCoreApplication::sendEvent(_textEdit, &event);
+        break;
+    }
+    case ITEInputTrace::MousePress:
+    case ITEInputTrace::MouseRelease:
+    case ITEInputTrace::MouseDoubleClick:
+    case ITEInputTrace::MouseMove: {
+        auto        viewport = _textEdit->viewport();
+        QMouseEvent event(typeOf(record.kind), record.point, viewport->mapToGlobal(record.point),
+                          Qt::MouseButton(record.button), Qt::MouseButtons(record.buttons), Qt::NoModifier);
+        QCoreApplication::sendEvent(viewport, &event);
+        break;
+    }
+    case ITEInputTrace::Scroll:
+        _textEdit->horizontalScrollBar()->setValue(record.point.x());
+        _textEdit->verticalScrollBar()->setValue(record.point.y());
+        break;
+    case ITEInputTrace::Resize:
+        _textEdit->resize(record.point.x(), record.point.y());
+        break;
+    default:
+        break;
+    }
+}
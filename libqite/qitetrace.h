@@ -0,0 +1,119 @@
+/*
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+#ifndef QITETRACE_H
+#define QITETRACE_H
+
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QObject>
+#include <QPoint>
+#include <QPointer>
+#include <QVector>
+
+class QEvent;
+class QIODevice;
+class QTextEdit;
+class QTimer;
+
+// Input trace of an InteractiveText: hover and mouse events of the text edit and its viewport, scroll positions and
+// resizes with their timing. Recorded with InteractiveText::setInputTrace, replayed with ITEInputReplayer.
+// Layout (QDataStream): QByteArray magic ("QITEINPT"), quint32 version,
+//   records of { quint32 msecs since the previous record, quint8 kind, qint32 x, qint32 y, quint8 button,
+//   quint8 buttons }. x and y are the event position, the scroll value or the text edit size depending on kind.
+class ITEInputTrace {
+public:
+    enum Kind : quint8 {
+        HoverEnter,
+        HoverMove,
+        HoverLeave,
+        MousePress,
+        MouseRelease,
+        MouseDoubleClick,
+        MouseMove,
+        Scroll,
+        Resize,
+        KindCount
+    };
+
+    struct Record {
+        quint32 delay; // ms since the previous record
+        Kind    kind;
+        QPoint  point;
+        quint8  button  = 0;
+        quint8  buttons = 0;
+    };
+
+    static const char    Magic[];
+    static const quint32 Version = 1;
+};
+
+// Writes the header and then records to a device opened for writing. The device is not owned
+class ITEInputTraceWriter {
+public:
+    explicit ITEInputTraceWriter(QIODevice *device);
+
+    inline QIODevice *device() const { return _stream.device(); }
+    void              write(ITEInputTrace::Kind kind, const QPoint &point, quint8 button = 0, quint8 buttons = 0);
+    // hover and resize events of the text edit or mouse events of its viewport. returns false for other events
+    bool writeEvent(QEvent *event, bool viewport);
+
+private:
+    QDataStream   _stream;
+    QElapsedTimer _clock;
+    qint64        _lastTime = 0;
+};
+
+// Feeds a recorded trace back into a text edit with an InteractiveText on it. Events are sent to the same widgets
+// at the same relative times, so hover sweeps and scroll flings are reproduced with their speed. Works with the
+// offscreen platform too (QT_QPA_PLATFORM=offscreen), so the replay may run headless in regression tests.
+class ITEInputReplayer : public QObject {
+    Q_OBJECT
+public:
+    explicit ITEInputReplayer(QTextEdit *textEdit, QObject *parent = nullptr);
+
+    bool                                         load(QIODevice *device); // false if it's not a trace
+    inline const QVector<ITEInputTrace::Record> &records() const { return _records; }
+
+    // 2.0 replays twice as fast. 0 sends the records one per event loop iteration without waiting
+    inline void setSpeed(double speed) { _speed = qMax(0.0, speed); }
+    void        start();
+    void        stop();
+    inline bool isRunning() const { return _running; }
+
+signals:
+    void finished();
+
+private:
+    void replayNext();
+    void dispatch(const ITEInputTrace::Record &record);
+
+private:
+    QPointer<QTextEdit>            _textEdit;
+    QVector<ITEInputTrace::Record> _records;
+    QVector<qint64>                _times; // ms since the start of each record
+    QTimer                        *_timer;
+    QElapsedTimer                  _clock;
+    double                         _speed   = 1.0;
+    int                            _next    = 0;
+    bool                           _running = false;
+    QPoint                         _lastHoverPos;
+};
+
+#endif // QITETRACE_H
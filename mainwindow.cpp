@@ -53,9 +53,13 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::MainWi
 
     connect(ui->textEdit, &QTextEdit::destroyed, [](QObject *) { qDebug("QTextEdit destoryed"); });
     auto itc = new InteractiveText(ui->textEdit); // global thing to handle all kinds of ITEs
+    itc->setPreloadMargin(ui->textEdit->fontMetrics().height() * 10);
+    itc->setDeferredPainting(true);
 
     atc = new ITEAudioController(itc, this);
     atc->setAutoFetchMetadata(true);
+    atc->setAutoGenerateHistogram(true);
+    atc->setAutoAdvance(true);
 
     auto musicDir = QStandardPaths::writableLocation(QStandardPaths::MusicLocation);
 
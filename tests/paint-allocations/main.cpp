@@ -0,0 +1,168 @@
+/*
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+// Repaints unchanged audio and progress elements and fails if that touches the heap.
+// operator new is replaced and, with glibc, malloc and friends too, since Qt containers allocate with malloc.
+// Where there is no display run it with QT_QPA_PLATFORM=offscreen (ctest does).
+
+#include "qiteaudio.h"
+#include "qiteprogress.h"
+
+#include <QApplication>
+#include <QImage>
+#include <QPainter>
+#include <QTextDocument>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace {
+const int Repaints = 100;
+
+std::atomic<bool> counting { false };
+std::atomic<long> allocations { 0 };
+
+inline void countAllocation()
+{
+    if (counting.load(std::memory_order_relaxed)) {
+        allocations++;
+    }
+}
+
+struct Element {
+    InteractiveTextElementController *controller;
+    int                               position;
+    QTextFormat                       format;
+    QRectF                            rect;
+};
+}
+
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void  __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+    countAllocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    countAllocation();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    countAllocation();
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+}
+#endif
+
+void *operator new(std::size_t size)
+{
+#ifndef __GLIBC__
+    countAllocation(); // otherwise malloc counts it
+#endif
+    if (void *ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+int main(int argc, char *argv[])
+{
+    QApplication app(argc, argv);
+
+    QTextDocument         doc;
+    InteractiveText       itc(&doc);
+    ITEAudioController    audio(&itc, nullptr);
+    ITEProgressController progress(&itc);
+    ITEBufferMediaOpener  opener;
+
+    // the histogram is painted column by column and the progress label goes through the static text cache
+    QByteArray amplitudes;
+    for (int i = 0; i < ITEAudioController::HistogramCompressedSize; i++) {
+        amplitudes.append(char(i * 2));
+    }
+    audio.insert(opener.add(QByteArray("not played, just painted"), amplitudes), &opener);
+    progress.insert(0, 100, QLatin1String("uploading"));
+
+    QList<Element> elements;
+    auto           collect = [&]() {
+        elements.clear();
+        QList<InteractiveTextElementController *> controllers { &audio, &progress }; // in the order of insertion
+        QTextCursor cursor(&doc);
+        while (!(cursor = doc.find(QString(QChar::ObjectReplacementCharacter), cursor)).isNull()
+               && elements.size() < controllers.size()) {
+            auto controller = controllers[elements.size()];
+            auto position   = cursor.selectionStart();
+            auto format     = cursor.charFormat();
+            QRectF rect(QPointF(0, elements.size() * 100), controller->intrinsicSize(&doc, position, format));
+            elements.append(Element { controller, position, format, rect });
+        }
+    };
+
+    QImage image(800, 200, QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::white);
+    QPainter painter(&image);
+
+    // warm up: metadata comes from the opener on the next event loop iterations, caches and glyphs get filled
+    for (int i = 0; i < 10; i++) {
+        collect();
+        for (auto const &e : std::as_const(elements)) {
+            e.controller->drawITE(&painter, e.rect, e.position, e.format);
+        }
+        app.processEvents();
+    }
+    collect();
+    if (elements.size() != 2) {
+        std::fprintf(stderr, "expected 2 elements, found %d\n", int(elements.size()));
+        return 1;
+    }
+
+    int failed = 0;
+    for (auto const &e : std::as_const(elements)) {
+        allocations = 0;
+        counting    = true;
+        for (int i = 0; i < Repaints; i++) {
+            e.controller->drawITE(&painter, e.rect, e.position, e.format);
+        }
+        counting = false;
+        std::printf("%s: %ld allocations in %d repaints\n", e.controller->metaObject()->className(),
+                    allocations.load(), Repaints);
+        if (allocations) {
+            failed++;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,11 @@
+QT     += core gui multimedia network widgets
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+TARGET = qite-paint-allocations
+TEMPLATE = app
+
+include($$PWD/../../libqite/libqite.pri)
+
+SOURCES += \
+    main.cpp
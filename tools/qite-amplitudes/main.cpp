@@ -0,0 +1,273 @@
+/*
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+// Offline generator of amplitudes metadata for a tree of audio files.
+//
+// Writes "<file>.amplitudes" sidecars next to the audio files (the same format AudioRecorder writes and
+// ITEAudioController reads) or, with --store, a single HistogramStore file which ITEAudioController loads with
+// loadHistogramStore(). Entries of deleted files are dropped from the store on each run.
+
+#include "qitehistogram.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QSaveFile>
+#include <QThread>
+
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace {
+const char SidecarSuffix[] = ".amplitudes";
+
+// Every worker owns a deque. It takes jobs from the front of its own one and steals from the back of others
+// when it runs out of work, so a few long files don't leave the rest of the cores idle.
+class WorkStealingQueue {
+public:
+    explicit WorkStealingQueue(int workers)
+    {
+        for (int i = 0; i < workers; i++) {
+            _deques.emplace_back(new Deque);
+        }
+    }
+
+    void push(int worker, const QString &job)
+    {
+        Deque       &d = *_deques[size_t(worker)];
+        QMutexLocker locker(&d.mutex);
+        d.jobs.push_back(job);
+    }
+
+    bool pop(int worker, QString &job)
+    {
+        {
+            Deque       &d = *_deques[size_t(worker)];
+            QMutexLocker locker(&d.mutex);
+            if (!d.jobs.empty()) {
+                job = d.jobs.front();
+                d.jobs.pop_front();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < _deques.size(); i++) {
+            Deque       &victim = *_deques[(size_t(worker) + i) % _deques.size()];
+            QMutexLocker locker(&victim.mutex);
+            if (!victim.jobs.empty()) {
+                job = victim.jobs.back();
+                victim.jobs.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    struct Deque {
+        QMutex              mutex;
+        std::deque<QString> jobs;
+    };
+    std::vector<std::unique_ptr<Deque>> _deques;
+};
+
+struct Stats {
+    std::atomic<int>    processed { 0 };
+    std::atomic<int>    failed { 0 };
+    std::atomic<qint64> audioMsecs { 0 };
+};
+
+bool writeSidecar(const QString &fileName, const QByteArray &histogram)
+{
+    QStringList columns;
+    columns.reserve(histogram.size());
+    for (auto v : histogram) {
+        columns.append(QString::number(quint8(v)));
+    }
+    QSaveFile f(fileName + QLatin1String(SidecarSuffix));
+    if (!f.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    f.write(columns.join(QLatin1Char(',')).toLatin1());
+    return f.commit();
+}
+
+// decodes the file in the calling thread. returns false on failure
+bool extract(const QString &fileName, QByteArray &histogram, qint64 &durationMsecs)
+{
+    QObject    scope; // owns the extractor, so it's gone with this function despite its deleteLater
+    QEventLoop loop;
+    bool       success   = false;
+    auto       extractor = new HistogramExtractor(QUrl::fromLocalFile(fileName), &scope);
+    QObject::connect(extractor, &HistogramExtractor::finished, &loop, [&](bool ok) {
+        success = ok;
+        if (ok) {
+            auto amplitudes = extractor->amplitudes();
+            histogram       = HistogramExtractor::compress(extractor->maxVolume(), amplitudes);
+            durationMsecs   = amplitudes.size() * HistogramExtractor::QuantumDuration / 1000;
+        } else {
+            qWarning("%s: %s", qPrintable(fileName), qPrintable(extractor->errorString()));
+        }
+        loop.quit();
+    });
+    extractor->start();
+    loop.exec();
+    return success && !histogram.isEmpty();
+}
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QLatin1String("qite-amplitudes"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        QLatin1String("Generates amplitudes metadata for audio files in a directory tree"));
+    parser.addHelpOption();
+    parser.addPositionalArgument(QLatin1String("directory"), QLatin1String("Root of the audio files tree"));
+    QCommandLineOption jobsOption(QStringList() << QLatin1String("j") << QLatin1String("jobs"),
+                                  QLatin1String("Amount of parallel workers (all cores by default)"),
+                                  QLatin1String("count"), QString::number(QThread::idealThreadCount()));
+    QCommandLineOption storeOption(QLatin1String("store"),
+                                   QLatin1String("Write a single binary store instead of .amplitudes sidecars"),
+                                   QLatin1String("file"));
+    QCommandLineOption extOption(QStringList() << QLatin1String("e") << QLatin1String("ext"),
+                                 QLatin1String("Comma separated list of file extensions to process"),
+                                 QLatin1String("list"), QLatin1String("mp4,m4a,aac,flac,mp3,ogg,opus,webm,wav"));
+    QCommandLineOption forceOption(QLatin1String("force"), QLatin1String("Regenerate even up to date metadata"));
+    parser.addOption(jobsOption);
+    parser.addOption(storeOption);
+    parser.addOption(extOption);
+    parser.addOption(forceOption);
+    parser.process(app);
+
+    if (parser.positionalArguments().size() != 1) {
+        parser.showHelp(1);
+    }
+    QDir root(parser.positionalArguments().first());
+    if (!root.exists()) {
+        qCritical("Directory %s doesn't exist", qPrintable(root.path()));
+        return 1;
+    }
+
+    int         workers   = qMax(1, parser.value(jobsOption).toInt());
+    bool        force     = parser.isSet(forceOption);
+    QString     storeName = parser.value(storeOption);
+    bool        useStore  = !storeName.isEmpty();
+    QStringList nameFilters;
+    for (auto const &ext : parser.value(extOption).split(QLatin1Char(','), Qt::SkipEmptyParts)) {
+        nameFilters << QLatin1String("*.") + ext.trimmed();
+    }
+
+    HistogramStore store(root.absolutePath());
+    int            pruned = 0;
+    if (useStore && QFile::exists(storeName)) {
+        if (store.load(storeName)) {
+            pruned = store.prune();
+        } else {
+            qWarning("Failed to read %s. It will be rewritten", qPrintable(storeName));
+        }
+    }
+
+    // collect what is out of date
+    WorkStealingQueue queue(workers);
+    int               queued  = 0;
+    int               skipped = 0;
+
+    QDirIterator it(root.absolutePath(), nameFilters, QDir::Files | QDir::NoSymLinks, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        auto      fileName = it.next();
+        QFileInfo fi(fileName);
+        if (!force) {
+            bool upToDate;
+            if (useStore) {
+                upToDate = store.find(fileName);
+            } else {
+                QFileInfo sidecar(fileName + QLatin1String(SidecarSuffix));
+                upToDate = sidecar.exists() && sidecar.lastModified() >= fi.lastModified();
+            }
+            if (upToDate) {
+                skipped++;
+                continue;
+            }
+        }
+        queue.push(queued++ % workers, fileName);
+    }
+
+    Stats         stats;
+    QMutex        storeMutex;
+    QElapsedTimer timer;
+    timer.start();
+
+    std::vector<QThread *> threads;
+    for (int i = 0; i < workers; i++) {
+        auto thread = QThread::create([&, i]() {
+            QString fileName;
+            while (queue.pop(i, fileName)) {
+                QByteArray histogram;
+                qint64     durationMsecs = 0;
+                bool       success       = extract(fileName, histogram, durationMsecs);
+                if (success) {
+                    if (useStore) {
+                        QMutexLocker locker(&storeMutex);
+                        store.insert(fileName, histogram);
+                    } else {
+                        success = writeSidecar(fileName, histogram);
+                    }
+                }
+                if (success) {
+                    stats.processed++;
+                    stats.audioMsecs += durationMsecs;
+                } else {
+                    stats.failed++;
+                }
+            }
+        });
+        thread->start();
+        threads.push_back(thread);
+    }
+    for (auto thread : threads) {
+        thread->wait();
+        delete thread;
+    }
+
+    if (useStore && !store.save(storeName)) {
+        qCritical("Failed to write %s", qPrintable(storeName));
+        return 1;
+    }
+
+    double seconds    = qMax(timer.elapsed(), qint64(1)) / 1000.0;
+    double audioHours = stats.audioMsecs / 3600000.0;
+    printf("processed: %d, failed: %d, skipped (up to date): %d, pruned: %d, workers: %d\n",
+           stats.processed.load(), stats.failed.load(), skipped, pruned, workers);
+    printf("elapsed: %.2f s, throughput: %.2f files/s, %.4f audio-hours/s (%.2f audio-hours total)\n", seconds,
+           (stats.processed + stats.failed) / seconds, audioHours / seconds, audioHours);
+
+    return stats.failed ? 2 : 0;
+}
@@ -0,0 +1,15 @@
+QT     += core multimedia
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+TARGET = qite-amplitudes
+TEMPLATE = app
+
+INCLUDEPATH += $$PWD/../../libqite
+
+SOURCES += \
+    main.cpp \
+    $$PWD/../../libqite/qitehistogram.cpp
+
+HEADERS += \
+    $$PWD/../../libqite/qitehistogram.h